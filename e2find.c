@@ -22,21 +22,61 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <regex.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <endian.h>
 #include <blkid/blkid.h>
 #include <ext2fs/ext2fs.h>
 
 static const char *program_name = "e2find";
 static const char *program_version = "0.6";
 
-static unsigned int opt_after = 0;
+static char *opt_after = NULL;
+static char *opt_filter = NULL;
 static int opt_show_mtime = 0;
 static int opt_show_ctime = 0;
 static int opt_debug = 0;
 static int opt_unique = 0;
 static int opt_mountpoint = 0;
 static int opt_image = 0;
+static char *opt_save_index = NULL;
+static char *opt_incremental = NULL;
+static int opt_journal = 0;
+static __u32 opt_journal_since = 0;
+static char *opt_diff = NULL;
+static int opt_show_change = 0;
+static char *opt_serve = NULL;
+static int opt_resolve_inodes = 0;
+static int opt_resolve_blocks = 0;
+static int opt_block_order = 0;
+static int opt_sum = 0; /* Run as e2sum */
+static int opt_archive = 0;
+static int opt_du = 0; /* Run as e2du */
+static int opt_ncdu = 0;
+static size_t opt_top = 0;
+static int opt_top_by = -1; /* --by key : */
+#define TOP_SIZE   0
+#define TOP_BLOCKS 1
+#define TOP_COUNT  2
+static int opt_usage = 0;
+static int opt_count = 0;
+static double opt_sample = 0;
+static struct array prefixes; /* Arrays of char *, from --include-subtree */
+static struct array excludes; /* and --exclude-subtree or --exclude-from */
+static char *opt_subtree = NULL;
+static int opt_binary = 0;
+static char *opt_compress = NULL;
+static int opt_sorted = 0;
 static char newline = '\n';
 
 static char *fspath;
@@ -51,13 +91,43 @@ static int buffer_blocks = 0;
 static struct option optl[] = {
   {"print0",     no_argument,       NULL, '0'},
   {"after",      required_argument, NULL, 'a'},
+  {"archive",    no_argument,       NULL, 'A'},
   {"show-ctime", no_argument,       NULL, 'c'},
+  {"show-change", no_argument,      NULL, 'C'},
   {"debug",      no_argument,       NULL, 'd'},
+  {"format",     required_argument, NULL, 'e'},
+  {"filter",     required_argument, NULL, 'f'},
+  {"name",       required_argument, NULL, 'g'},
+  {"iname",      required_argument, NULL, 'G'},
+  {"regex",      required_argument, NULL, 'E'},
+  {"include-subtree", required_argument, NULL, 'x'},
+  {"path-prefix", required_argument, NULL, 'x'},
+  {"exclude-subtree", required_argument, NULL, 'X'},
+  {"exclude-from", required_argument, NULL, 'F'},
+  {"diff",       required_argument, NULL, 'D'},
   {"help",       no_argument,       NULL, 'h'},
   {"image",      no_argument,       NULL, 'i'},
+  {"incremental", required_argument, NULL, 'I'},
+  {"journal",    optional_argument, NULL, 'j'},
   {"show-mtime", no_argument,       NULL, 'm'},
+  {"count",      no_argument,       NULL, 'n'},
+  {"save-index", required_argument, NULL, 'o'},
   {"mountpoint", no_argument,       NULL, 'p'},
+  {"sample",     required_argument, NULL, 'P'},
+  {"ncdu",       no_argument,       NULL, 'N'},
+  {"resolve-blocks", no_argument,   NULL, 'b'},
+  {"block-order", no_argument,      NULL, 'B'},
+  {"binary",     no_argument,       NULL, 'R'},
+  {"compress",   required_argument, NULL, 'z'},
+  {"sorted",     no_argument,       NULL, 'O'},
+  {"resolve-inodes", no_argument,   NULL, 'r'},
+  {"serve",      required_argument, NULL, 'S'},
+  {"summary",    no_argument,       NULL, 's'},
+  {"top",        required_argument, NULL, 't'},
+  {"subtree",    required_argument, NULL, 'T'},
+  {"by",         required_argument, NULL, 'y'},
   {"unique",     no_argument,       NULL, 'u'},
+  {"usage",      optional_argument, NULL, 'U'},
   {"version",    no_argument,       NULL, 'v'},
   {NULL, 0, NULL, 0},
 };
@@ -67,9 +137,14 @@ static struct option optl[] = {
 #define err(ret, msg, ...) do { fprintf(stderr, "%s: " msg "\n", program_name, ##__VA_ARGS__); exit(ret); } while (0);
 
 
-/* Two bitfields to store per-inode flags, they are bit-addressed by #ino */
-static char *iisdir  = NULL;
-static char *iselect = NULL;
+/* Bitfields to store per-inode flags, they are bit-addressed by #ino */
+static char *iisdir   = NULL;
+static char *iselect  = NULL;
+static char *idirkeep = NULL; /* Unchanged folders (--incremental) */
+static char *ijournal = NULL; /* Inode table block logged in the journal (--journal) */
+static char *gjournal = NULL; /* Same, by block group (bit-addressed by group) */
+static char *iwanted  = NULL; /* Inodes read from stdin (--resolve-inodes) */
+static char *isubtree = NULL; /* Inodes within --subtree */
 
 void bitfield_init(char** buffer, size_t nb_bits) {
   size_t bytes;
@@ -147,18 +222,11 @@ int array_add(struct array *a, void *elt, size_t bytes) {
 struct inode_t {
   ext2_ino_t   ino;
   unsigned int dirent;
-  __u32        time1;
-  __u32        time2;
+  char         fields[]; /* Those needed by the output, see format_layout() */
 };
 
 struct array inodes;  /* Array of inode_t structs */
 size_t inodes_elsize;
-enum {
-  INODES_NONE,
-  INODES_MTIME,
-  INODES_CTIME,
-  INODES_MTIME_CTIME,
-} inodes_eltype;
 
 struct dirent_empty_t { /* Only used to sizeof() the struct without the variable name[] array */
   unsigned int ino;
@@ -170,33 +238,368 @@ struct dirent_t {
   char name[255+3];
 };
 struct array dirents; /* Array of dirent_t structs, those are variable size elements */
+struct array first_blocks; /* __u64 per inodes[] element, only for --block-order */
+
+/* e2du : own usage of an inode, then the total of its subtree for folders
+ * (--ncdu only needs the former) */
+struct du_t {
+  __u64 size;   /* Apparent, in bytes */
+  __u64 blocks; /* Allocated, in 512-byte units */
+  __u64 count;  /* Inodes */
+  __u32 mtime;
+  __u16 mode;
+  __u16 links;
+};
+struct array du_sizes; /* du_t per inodes[] element, only for e2du and --ncdu */
+static char *idu = NULL; /* Bit-addressed by #ino, set once counted (hard links) */
+
+/* --usage : totals of the selected inodes per owner, group and age */
+#define USAGE_INODES 1 /* Pass 1 only */
+#define USAGE_DIRS   2 /* Also per top-level folder, needs pass 2 */
+#define USAGE_AGES   7
+
+struct usage_t {
+  __u32 id;     /* uid or gid */
+  __u64 size;
+  __u64 blocks;
+  __u64 count;
+};
+static struct array usage_uids; /* Arrays of usage_t, sorted by id */
+static struct array usage_gids;
+static struct usage_t usage_ages[USAGE_AGES];
+static const __u32 usage_age_max[USAGE_AGES - 1] = { 86400, 7*86400, 30*86400, 90*86400, 365*86400, 3*365*86400 };
+static const char *usage_age_names[USAGE_AGES] = { "1d", "7d", "30d", "90d", "1y", "3y", "older" };
+static time_t usage_now;
+
+/* --count and --summary : totals of the selected inodes per type and per
+ * link count (powers of two) */
+#define COUNT_INODES  1
+#define COUNT_SUMMARY 2
+#define COUNT_TYPES   8
+#define COUNT_LINKS   17
+
+struct count_t {
+  __u64 count;
+  __u64 size;
+  __u64 blocks;
+};
+static struct count_t count_types[COUNT_TYPES];
+static const char *count_type_names[COUNT_TYPES] = {
+  "file", "folder", "symlink", "chardev", "blockdev", "fifo", "socket", "other"
+};
+static __u64 count_links[COUNT_LINKS]; /* [n] : links in (2^(n-1), 2^n] */
+
+/* As a vector : totals (count, size, blocks), types (same), links */
+#define COUNT_VALUES (3 + COUNT_TYPES * 3 + COUNT_LINKS)
+static double count_margins[COUNT_VALUES]; /* --sample : 95% confidence */
+static int count_margined = 0;             /* Margins are known (2+ groups sampled) */
+
+/* Pass 1 counters */
+static unsigned int inodes_scanned  = 0;
+static unsigned int inodes_used     = 0;
+static unsigned int inodes_selected = 0;
+
+
+/* Inode times, packed : seconds since 1901-12-13 (the epoch - 2^31) on 34 bits
+ * as ext4 stores them, then nanoseconds on 30 bits. They compare as integers. */
+#define TIME_PACK(sec, ns) ((((__u64)((sec) + 0x80000000LL)) << 30) | (ns))
+#define TIME_SEC(t)        ((long long)((t) >> 30) - 0x80000000LL)
+#define TIME_NS(t)         ((__u32)((t) & 0x3fffffff))
+
+/* All the inode metadata we may need from a used inode, whether it has been
+ * read from the inode table or from a previous scan index. */
+struct inode_meta_t {
+  ext2_ino_t ino;
+  __u16      mode;
+  __u16      links;
+  __u32      uid;
+  __u32      gid;
+  __u32      flags;
+  __u32      generation;
+  __u64      atime;  /* Packed, see TIME_PACK() */
+  __u64      ctime;
+  __u64      mtime;
+  __u64      crtime;
+  __u64      size;
+  __u64      blocks; /* In 512-byte units, as stat(2) */
+  __u64      first_block; /* Physical block of the first extent, 0 if none */
+};
+
+/* Inode fields which may be stored in inodes[] for the output */
+#define FIELD_SIZE   0
+#define FIELD_BLOCKS 1
+#define FIELD_UID    2
+#define FIELD_GID    3
+#define FIELD_MTIME  4
+#define FIELD_CTIME  5
+#define FIELD_ATIME  6
+#define FIELD_CRTIME 7
+#define FIELD_MODE   8
+#define FIELD_LINKS  9
+#define FIELD_MTIME_NS  10
+#define FIELD_CTIME_NS  11
+#define FIELD_ATIME_NS  12
+#define FIELD_CRTIME_NS 13
+#define FIELDS       14
+
+/* Times are either stored packed, or as signed seconds (before 1970 and after
+ * 2106 alike) when nanoseconds are not needed */
+static const struct { size_t offset; size_t size; int seconds; } inode_fields[FIELDS] = {
+  { offsetof(struct inode_meta_t, size),   8, 0 },
+  { offsetof(struct inode_meta_t, blocks), 8, 0 },
+  { offsetof(struct inode_meta_t, uid),    4, 0 },
+  { offsetof(struct inode_meta_t, gid),    4, 0 },
+  { offsetof(struct inode_meta_t, mtime),  8, 1 },
+  { offsetof(struct inode_meta_t, ctime),  8, 1 },
+  { offsetof(struct inode_meta_t, atime),  8, 1 },
+  { offsetof(struct inode_meta_t, crtime), 8, 1 },
+  { offsetof(struct inode_meta_t, mode),   2, 0 },
+  { offsetof(struct inode_meta_t, links),  2, 0 },
+  { offsetof(struct inode_meta_t, mtime),  8, 0 },
+  { offsetof(struct inode_meta_t, ctime),  8, 0 },
+  { offsetof(struct inode_meta_t, atime),  8, 0 },
+  { offsetof(struct inode_meta_t, crtime), 8, 0 },
+};
+static int inode_fields_at[FIELDS]; /* Offset in inode_t.fields, -1 if not stored */
+static int inode_fields_needed[FIELDS];
+
+#define INODE_FIELDS_BYTES 96 /* All of them */
+
+/* inodes[] element layout : the needed fields, largest first for alignment */
+void format_layout() {
+  size_t bytes = 0;
+  size_t size;
+  int n;
+
+  for (size = 8; size; size /= 2)
+    for (n = 0; n < FIELDS; n++) {
+      if (inode_fields[n].size != size)
+        continue;
+      inode_fields_at[n] = inode_fields_needed[n] ? bytes : -1;
+      if (inode_fields_needed[n])
+        bytes += size;
+    }
+  inodes_elsize = sizeof(struct inode_t) + ((bytes + 3) & ~3);
+  dbg("inodes[] element size is %zu bytes", inodes_elsize);
+}
+
+__u64 inode_field(struct inode_t *i, int field) {
+  __u64 v64;
+  __u32 v32;
+  __u16 v16;
+
+  switch (inode_fields[field].size) {
+    case 8:
+      memcpy(&v64, i->fields + inode_fields_at[field], 8);
+      return v64;
+    case 4:
+      memcpy(&v32, i->fields + inode_fields_at[field], 4);
+      return v32;
+    default:
+      memcpy(&v16, i->fields + inode_fields_at[field], 2);
+      return v16;
+  }
+}
+
+/* Scan index : the results of pass 1 and 2, saved with --save-index and
+ * reused by a later --incremental run. It is written sequentially while
+ * scanning and has the following layout :
+ *
+ *   struct index_header_t
+ *   struct index_group_t  [group_count]
+ *   struct inode_meta_t   [inodes]   sorted by inode number
+ *   struct dirent_t       [dirents]  grouped by parent folder, in parent inode
+ *                                    order ; .ino and .parent are inode numbers
+ *
+ * Integers are stored in host byte order, an index is thus not portable
+ * between architectures. */
+#define INDEX_MAGIC   "e2findx"
+#define INDEX_VERSION 4
+
+struct index_header_t {
+  char  magic[8];
+  __u32 version;
+  __u32 group_count;
+  __u32 inodes_per_group;
+  __u32 inodes_count;
+  __u8  uuid[16];
+  __u64 time;          /* Scan start, as epoch */
+  __u64 inodes;        /* Number of inode_meta_t records */
+  __u64 dirents;       /* Number of dirent_t records */
+  __u64 dirents_bytes; /* Size of the dirent_t section */
+  __u32 journal_seq;   /* Next journal transaction at scan start (0: unknown) */
+  __u32 journal_block; /* Journal block where it is expected */
+};
+
+/* Block group descriptor state : if none of these fields changed, we assume
+ * that the group's inode table did not change either. */
+struct index_group_t {
+  __u64 free_blocks;
+  __u32 free_inodes;
+  __u32 used_dirs;
+  __u32 itable_unused;
+  __u32 ibitmap_csum;
+  __u16 flags;
+  __u16 checksum;
+  __u32 reserved;
+};
+
+/* A loaded index, sections point into the mmap()ed file */
+struct index_t {
+  char                  *map;
+  size_t                 size;
+  struct index_header_t *header;
+  struct index_group_t  *groups;
+  struct inode_meta_t   *inodes;
+  char                  *dirents;
+  char                  *isdir;      /* See index_dirs() */
+  struct index_dir_t    *dirs;
+  size_t                 dirs_count;
+};
+
+/* Folder inode to its (single) dirent in an index */
+struct index_dir_t {
+  ext2_ino_t ino;
+  __u64      offset;
+};
+
+static struct index_t previous;       /* From --incremental */
+static struct index_t diffbase;       /* From --diff */
+static char *diff_tmp = NULL;         /* Current scan index for --diff */
+static FILE *index_out = NULL;        /* To --save-index */
+static char *index_out_tmp = NULL;
+static struct index_header_t index_out_header;
 
 
 void show_help() {
   printf(
     "Usage: e2find [options] /path\n" \
+    "       e2find [options] --diff OLD-IDX NEW-IDX\n" \
+    "       e2sum [options] /path\n" \
+    "       e2du [options] /path\n" \
     "\n" \
     "List all inodes of an ext2/3/4 filesystem, by name, as efficiently\n" \
     "as possible (ie. do not recursively traverse directory entries).\n" \
     "Path may be a file or folder on a filesystem (eg. /var), or a\n" \
     "backing block device (eg. /dev/sda1).\n" \
     "\n" \
+    "As e2sum, show the SHA-256 of regular files (as sha256sum does),\n" \
+    "reading the disk in a single sweep in physical block order.\n" \
+    "As e2du, show the folders using the most space, as 'allocated\n" \
+    "apparent inodes path' (sizes in bytes, hard links counted once).\n" \
+    "\n" \
     "Options :\n" \
     "\n" \
     "  -0, --print0          Use 0 characters instead of newlines\n" \
     "  -a, --after TIMESPEC  Only show files modified after TIMESPEC\n" \
+    "  -A, --archive         Write the files as a tar archive on stdout,\n" \
+    "                        reading the disk in a single sweep\n" \
+    "  -b, --resolve-blocks  Show the files using the blocks read from\n" \
+    "                        stdin, as 'block path'\n" \
+    "  -B, --block-order     Sort output by first physical block, for\n" \
+    "                        near sequential reads of the files\n" \
     "  -c, --ctime           Prefix file names with ctime (as epoch)\n" \
+    "  -C, --show-change     Prefix --diff paths with their change\n" \
     "  -d, --debug           Show debug/progress informations\n" \
+    "  -D, --diff IDX        Show paths changed since the IDX index\n" \
+    "  -e, --format FORMAT   Output format, see below (eg. '%%s %%p\\n')\n" \
+    "  -E, --regex REGEX     Only show the names matching REGEX (extended)\n" \
+    "  -f, --filter EXPR     Only show the inodes matching EXPR, see below\n" \
+    "  -F, --exclude-from FILE  Same as --exclude-subtree, for each line\n" \
+    "                        of FILE (except empty and # lines)\n" \
+    "  -g, --name GLOB       Only show the names matching GLOB\n" \
+    "  -G, --iname GLOB      Same, case insensitive\n" \
     "  -h, --help            This help\n" \
     "  -i, --image           Open /path as an image file\n" \
+    "  -I, --incremental IDX Only read inode tables of block groups\n" \
+    "                        and folders which changed since the IDX\n" \
+    "                        scan index\n" \
+    "  -j, --journal[=SEQ]   Only show inodes changed by journal\n" \
+    "                        transactions since the --incremental\n" \
+    "                        index was saved (or since SEQ)\n" \
+    "  -n, --count           Only count the selected inodes and folders\n" \
+    "  -N, --ncdu            Export the whole tree in ncdu's JSON format\n" \
+    "                        (see ncdu -f)\n" \
+    "  -o, --save-index IDX  Save scan results to the IDX index file\n" \
+    "  -O, --sorted          Sort output by path, as LC_ALL=C sort\n" \
     "  -p, --mountpoint      Ensure /path is the fs mountpoint\n" \
+    "  -P, --sample PERCENT  With --count or --summary, only read PERCENT\n" \
+    "                        of the block groups and extrapolate, as\n" \
+    "                        'value~margin' (95%% confidence)\n" \
+    "  -r, --resolve-inodes  Only show the inodes read from stdin\n" \
+    "  -R, --binary          Binary records for programs : the --format\n" \
+    "                        fields and the path, see the README\n" \
+    "  -s, --summary         Only count the selected inodes, per type and\n" \
+    "                        per link count, with their sizes\n" \
+    "  -S, --serve SOCKET    Keep scan results in memory and answer\n" \
+    "                        queries on the SOCKET Unix socket\n" \
+    "  -t, --top N           Only show the N largest files (or folders\n" \
+    "                        with e2du, 20 by default), largest first\n" \
+    "  -T, --subtree PATH    Only read the PATH folder and below, instead\n" \
+    "                        of every inode table and folder\n" \
     "  -m, --mtime           Prefix file names with mtime (as epoch)\n" \
     "  -u, --unique          Output at most one name per inode\n" \
+    "  -U, --usage[=dirs]    Show the totals of the selected inodes per\n" \
+    "                        uid, gid and mtime age (and top-level folder)\n" \
     "  -v, --version         Show program name and version)\n" \
+    "  -x, --include-subtree PATH  Only show PATH and the paths below it\n" \
+    "                        (also --path-prefix)\n" \
+    "  -X, --exclude-subtree PATH  Do not show PATH nor the paths below it\n" \
+    "  -y, --by KEY          --top key : size, blocks (allocated) or\n" \
+    "                        count (inodes, e2du only)\n" \
+    "  -z, --compress TOOL   Compress the output with zstd or lz4 (which\n" \
+    "                        must be installed), as it is written\n" \
     "\n" \
-    "TIMESPEC is expressed as Unix epoch (local) time.\n" \
+    "TIMESPEC is expressed as Unix epoch (local) time, with an optional\n" \
+    "fraction (eg. 1441461259.25).\n" \
     "If both --show-mtime and --show-ctime are used, mtime is\n" \
-    "displayed first and ctime last.\n");
+    "displayed first and ctime last.\n" \
+    "\n" \
+    "--filter expressions combine tests with and (implied), or, not and\n" \
+    "parentheses, eg. 'type f and (size > 1G or mtime < 365d)' :\n" \
+    "  type f,d,l,c,b,p,s       File type(s)\n" \
+    "  FIELD OP VALUE           FIELD is size, blocks, uid, gid, links,\n" \
+    "                           ino, mtime, ctime, atime or crtime ;\n" \
+    "                           OP is <, <=, >, >=, = or !=\n" \
+    "  perm [-/]MODE            Octal mode, exactly, all (-) or any (/)\n" \
+    "  flag NAME                immutable, append, nodump, noatime,\n" \
+    "                           index, extents, inline or encrypt\n" \
+    "  after TIME               mtime or ctime >= TIME (as --after)\n" \
+    "Values take k, M, G, T suffixes. Times are epochs, or durations\n" \
+    "ago with s, m, h, d, w suffixes (mtime > 1d : modified today).\n" \
+    "\n" \
+    "--format directives are, as find -printf's : %%i (inode), %%s (size),\n" \
+    "%%b (512-byte blocks), %%m (octal mode), %%M (as ls -l), %%y (type),\n" \
+    "%%U, %%G, %%n (links), %%T@, %%C@, %%A@, %%B@ (m/c/a/crtime as epochs\n" \
+    "with nanoseconds, or %%Ts... for whole seconds), %%p (path),\n" \
+    "%%f (basename), %%h (dirname) and %%%%, with an optional\n" \
+    "width (%%-10s). \\n, \\t and \\0 are escapes, no newline is added.\n" \
+    "\n" \
+    "--name, --iname and --regex match the whole file name (not its\n" \
+    "path), a name is shown if any of them matches. Subtree paths are\n" \
+    "relative to the filesystem root, the nearest included or excluded\n" \
+    "folder wins. All may be repeated.\n" \
+    "\n" \
+    "--incremental trusts block group descriptors : changes which do not\n" \
+    "allocate nor free any inode or block (eg. chmod, in-place rewrite)\n" \
+    "are not seen until the group changes. Run a full scan regularly.\n" \
+    "--diff lists paths to be synced, suitable for rsync --files-from.\n" \
+    "Changes are N (new), D (deleted), R (existing inode with a new\n" \
+    "name, or within a renamed folder), U (data) and M (metadata).\n" \
+    "--journal only relies on the journal : it fails if the transactions\n" \
+    "since the index have already been overwritten.\n" \
+    "\n" \
+    "--resolve-inodes and --resolve-blocks read numbers separated by\n" \
+    "blanks, and warn about those which are not in use.\n" \
+    "\n" \
+    "--serve queries are lines, each answered by lines ending with an\n" \
+    "empty line (or 'error: ...') :\n" \
+    "  ino N       Paths of inode #N\n" \
+    "  path PATH   Inode number of PATH\n" \
+    "  ls PATH     PATH and all paths below it\n" \
+    "  after T     Paths modified after T (same as --after)\n" \
+    "  refresh     Scan again, from the --save-index index if any\n" \
+    "  quit        Close the connection\n");
 }
 
 void show_version() {
@@ -204,6 +607,178 @@ void show_version() {
 }
 
 
+void group_state(dgrp_t group, struct index_group_t *g) {
+  memset(g, 0, sizeof(*g));
+  g->free_blocks   = ext2fs_bg_free_blocks_count(fs, group);
+  g->free_inodes   = ext2fs_bg_free_inodes_count(fs, group);
+  g->used_dirs     = ext2fs_bg_used_dirs_count(fs, group);
+  g->itable_unused = ext2fs_bg_itable_unused(fs, group);
+  g->ibitmap_csum  = ext2fs_inode_bitmap_checksum(fs, group);
+  g->flags         = ext2fs_bg_flags(fs, group);
+  g->checksum      = ext2fs_bg_checksum(fs, group);
+}
+
+/* Index output is written to a temporary file which is renamed when complete,
+ * thus the same path may be used for --incremental and --save-index. */
+void index_create(const char *path) {
+  dgrp_t group;
+
+  if (asprintf(&index_out_tmp, "%s.tmp", path) < 0)
+    err(6, "asprintf() for index path");
+  index_out = fopen(index_out_tmp, "w");
+  if (!index_out)
+    err(12, "fopen(%s): %s", index_out_tmp, strerror(errno));
+  dbg("index: writing to '%s'", index_out_tmp);
+
+  /* Counters are patched by index_finish() */
+  memset(&index_out_header, 0, sizeof(index_out_header));
+  memcpy(index_out_header.magic, INDEX_MAGIC, sizeof(index_out_header.magic));
+  index_out_header.version          = INDEX_VERSION;
+  index_out_header.group_count      = fs->group_desc_count;
+  index_out_header.inodes_per_group = fs->super->s_inodes_per_group;
+  index_out_header.inodes_count     = fs->super->s_inodes_count;
+  index_out_header.time             = time(NULL);
+  memcpy(index_out_header.uuid, fs->super->s_uuid, sizeof(index_out_header.uuid));
+  fwrite(&index_out_header, sizeof(index_out_header), 1, index_out);
+
+  for (group = 0; group < fs->group_desc_count; group++) {
+    struct index_group_t g;
+
+    group_state(group, &g);
+    fwrite(&g, sizeof(g), 1, index_out);
+  }
+}
+
+void index_finish(const char *path) {
+  if (fseek(index_out, 0, SEEK_SET) != 0 ||
+      fwrite(&index_out_header, sizeof(index_out_header), 1, index_out) != 1 ||
+      fclose(index_out) != 0)
+    err(12, "writing index '%s': %s", index_out_tmp, strerror(errno));
+  if (rename(index_out_tmp, path) != 0)
+    err(12, "rename(%s, %s): %s", index_out_tmp, path, strerror(errno));
+  dbg("index: saved to '%s' (%llu inodes, %llu dirents)", path,
+    (unsigned long long)index_out_header.inodes, (unsigned long long)index_out_header.dirents);
+  index_out = NULL;
+}
+
+void index_add_inode(struct inode_meta_t *m) {
+  if (fwrite(m, sizeof(*m), 1, index_out) != 1)
+    err(12, "writing index '%s': %s", index_out_tmp, strerror(errno));
+  index_out_header.inodes++;
+}
+
+void index_add_dirent(struct dirent_t *d, size_t bytes) {
+  if (fwrite(d, bytes, 1, index_out) != 1)
+    err(12, "writing index '%s': %s", index_out_tmp, strerror(errno));
+  index_out_header.dirents++;
+  index_out_header.dirents_bytes += bytes;
+}
+
+int index_is(const char *path) {
+  char magic[8];
+  FILE *f;
+  int ret;
+
+  f = fopen(path, "r");
+  if (!f)
+    return 0;
+  ret = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0;
+  fclose(f);
+  return ret;
+}
+
+/* The dirent section must be walkable : every name ends within it, and the
+ * records add up to the header's count and size */
+int index_dirents_check(struct index_header_t *h, char *dirents) {
+  __u64 offset = 0;
+  __u64 count = 0;
+
+  while (offset < h->dirents_bytes) {
+    struct dirent_t *d = (struct dirent_t *)(dirents + offset);
+    __u64 left = h->dirents_bytes - offset;
+    char *end;
+
+    if (left <= sizeof(struct dirent_empty_t))
+      return 0;
+    left -= sizeof(struct dirent_empty_t);
+    end = memchr(d->name, '\0', left < 256 ? left : 256);
+    if (!end)
+      return 0;
+    offset += sizeof(struct dirent_empty_t) + ((end - d->name + 4) & ~3);
+    count++;
+  }
+  return offset == h->dirents_bytes && count == h->dirents;
+}
+
+/* Map an index previously written by --save-index. Returns 0 and leaves idx
+ * untouched if it cannot be used with the current filesystem (if opened). */
+int index_load(const char *path, struct index_t *idx) {
+  struct index_header_t *h;
+  struct stat stat;
+  size_t expected;
+  char *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "warning: index '%s': %s\n", path, strerror(errno));
+    return 0;
+  }
+  if (fstat(fd, &stat) != 0)
+    err(13, "fstat(%s): %s", path, strerror(errno));
+  if (stat.st_size < sizeof(*h)) {
+    fprintf(stderr, "warning: index '%s': truncated file\n", path);
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    err(13, "mmap(%s): %s", path, strerror(errno));
+
+  h = (struct index_header_t *)map;
+  if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 || h->version != INDEX_VERSION) {
+    fprintf(stderr, "warning: index '%s': not an e2find index (or wrong version)\n", path);
+    goto unusable;
+  }
+  /* Section counts are bounded by the file size first, so that they cannot
+   * overflow the expected size */
+  expected = 0;
+  if (h->group_count <= stat.st_size / sizeof(struct index_group_t) &&
+      h->inodes <= stat.st_size / sizeof(struct inode_meta_t) && h->dirents_bytes <= stat.st_size)
+    expected = sizeof(*h) + h->group_count * sizeof(struct index_group_t) +
+      h->inodes * sizeof(struct inode_meta_t) + h->dirents_bytes;
+  if (stat.st_size != expected) {
+    fprintf(stderr, "warning: index '%s': size mismatch (%zu bytes, %zu expected)\n", path, (size_t)stat.st_size, expected);
+    goto unusable;
+  }
+  if (fs && (memcmp(h->uuid, fs->super->s_uuid, sizeof(h->uuid)) != 0 ||
+      h->group_count != fs->group_desc_count ||
+      h->inodes_per_group != fs->super->s_inodes_per_group)) {
+    fprintf(stderr, "warning: index '%s': made from another filesystem\n", path);
+    goto unusable;
+  }
+  if (!index_dirents_check(h, map + stat.st_size - h->dirents_bytes)) {
+    fprintf(stderr, "warning: index '%s': corrupted dirents\n", path);
+    goto unusable;
+  }
+
+  idx->map     = map;
+  idx->size    = stat.st_size;
+  idx->header  = h;
+  idx->groups  = (struct index_group_t *)(map + sizeof(*h));
+  idx->inodes  = (struct inode_meta_t *)(idx->groups + h->group_count);
+  idx->dirents = (char *)(idx->inodes + h->inodes);
+  dbg("index: loaded '%s' (%llu inodes, %llu dirents)", path,
+    (unsigned long long)h->inodes, (unsigned long long)h->dirents);
+  return 1;
+
+unusable:
+  munmap(map, stat.st_size);
+  return 0;
+}
+
+
 struct inode_t * inode_lookup(ext2_ino_t ino, unsigned int *pos) {
   char *inode_p;
   struct inode_t *i = NULL;
@@ -239,7 +814,7 @@ struct inode_t * inode_lookup(ext2_ino_t ino, unsigned int *pos) {
 
     //dbg("lookup(%d): going up", ino);
     do {
-      if (index >= inodes.count)
+      if (index + 1 >= (int)inodes.count)
         return NULL;
       index++;
       i = (struct inode_t *)(inode_p + inodes_elsize * index);
@@ -266,22 +841,185 @@ struct inode_t * inode_lookup(ext2_ino_t ino, unsigned int *pos) {
   return NULL;
 }
 
+/* Name filters (--name, --iname, --regex) : all patterns are translated into
+ * a single extended regex (one more for --iname), so that a name is matched
+ * against all of them at once. Patterns match the whole name. */
+struct names_t {
+  char    *expr; /* Alternation of the patterns, as (p1)|(p2)... */
+  size_t   len;
+  regex_t  re;
+};
+static struct names_t names[2]; /* [1] : case insensitive */
+static int names_count = 0;
+
+/* Appends a pattern to the alternation, globs are translated on the way */
+void names_add(int icase, const char *pattern, int glob) {
+  struct names_t *n = &names[icase];
+  const char *bracket;
+  char *p;
+
+  p = realloc(n->expr, n->len + 2 * strlen(pattern) + 5);
+  if (!p)
+    err(6, "realloc() for --name");
+  n->expr = p;
+  p += n->len;
+  if (n->len)
+    *p++ = '|';
+  *p++ = '(';
+  for (; *pattern; pattern++) {
+    if (!glob) {
+      *p++ = *pattern;
+      continue;
+    }
+    switch (*pattern) {
+      case '*':
+        *p++ = '.';
+        *p++ = '*';
+        break;
+      case '?':
+        *p++ = '.';
+        break;
+      case '[':
+        /* Same syntax, but for the negation. A ] first is literal. */
+        bracket = pattern + 1;
+        if (*bracket == '!' || *bracket == '^')
+          bracket++;
+        if (*bracket == ']')
+          bracket++;
+        bracket = strchr(bracket, ']');
+        if (!bracket) {
+          *p++ = '\\';
+          *p++ = '[';
+          break;
+        }
+        *p++ = '[';
+        if (*++pattern == '!') {
+          *p++ = '^';
+          pattern++;
+        }
+        for (; pattern <= bracket; pattern++)
+          *p++ = *pattern;
+        pattern--;
+        break;
+      case '\\':
+        if (pattern[1])
+          pattern++;
+        /* Fall through */
+      default:
+        if (strchr(".[]*?^$+(){}|\\", *pattern))
+          *p++ = '\\';
+        *p++ = *pattern;
+    }
+  }
+  *p++ = ')';
+  n->len = p - n->expr;
+  names_count++;
+}
+
+void names_compile() {
+  char msg[256];
+  char *expr;
+  int i;
+  int ret;
+
+  for (i = 0; i < 2; i++) {
+    if (!names[i].len)
+      continue;
+    expr = malloc(names[i].len + 5);
+    if (!expr)
+      err(6, "malloc() for --name");
+    sprintf(expr, "^(%.*s)$", (int)names[i].len, names[i].expr);
+    dbg("--name: %s", expr);
+    ret = regcomp(&names[i].re, expr, REG_EXTENDED | REG_NOSUB | (i ? REG_ICASE : 0));
+    if (ret) {
+      regerror(ret, &names[i].re, msg, sizeof(msg));
+      err(11, "--name, --iname or --regex: %s", msg);
+    }
+    free(expr);
+  }
+}
+
+int names_match(const char *name, int name_len) {
+  char buf[256];
+
+  memcpy(buf, name, name_len);
+  buf[name_len] = '\0';
+  return (names[0].len && regexec(&names[0].re, buf, 0, NULL, 0) == 0) ||
+         (names[1].len && regexec(&names[1].re, buf, 0, NULL, 0) == 0);
+}
+
 struct dirent_cb_t {
   ext2_ino_t parent_ino;
   unsigned int parent_ino_idx;
 };
 
-int dirent_cb(struct ext2_dir_entry *dirent, int offset, int blocksize, char *buf, void *private) {
-  struct dirent_cb_t *cb;
-  char *name;
-  int name_len;
-  ext2_ino_t ino;
+/* e2du : files are summed into their folder as soon as their entry is met,
+ * their dirents are not kept. Folders are summed by du_run(). */
+void du_leaf(ext2_ino_t ino, unsigned int parent_ino_idx) {
+  struct du_t *du = (struct du_t *)du_sizes.buffer;
+  unsigned int ino_idx;
+
+  if (bitfield_get(idu, ino) || !inode_lookup(ino, &ino_idx))
+    return;
+  bitfield_set(idu, ino);
+  du[parent_ino_idx].size   += du[ino_idx].size;
+  du[parent_ino_idx].blocks += du[ino_idx].blocks;
+  du[parent_ino_idx].count  += du[ino_idx].count;
+}
+
+/* Record a folder entry into dirents[], and reference it from its inode */
+void dirent_add(ext2_ino_t ino, char *name, int name_len, ext2_ino_t parent_ino, unsigned int parent_ino_idx) {
   unsigned int ino_idx;
   struct inode_t *i;
   struct dirent_t d;
   int padding;
   int p;
 
+  if ((opt_du || opt_usage) && !opt_ncdu && !bitfield_get(iisdir, ino)) {
+    du_leaf(ino, parent_ino_idx);
+    if (opt_usage && !index_out)
+      return;
+  }
+
+  /* Only folders (as ancestors) and selected inodes are needed by pass 3,
+   * unless the whole tree is kept for an index, --serve or --ncdu. Files
+   * are matched by name here, before being stored. */
+  if (!index_out && !opt_serve && !opt_ncdu && !bitfield_get(iisdir, ino) &&
+      (!bitfield_get(iselect, ino) || (names_count && !names_match(name, name_len))))
+    return;
+
+  i = inode_lookup(ino, &ino_idx);
+  if (!i) {
+    fprintf(stderr, "warning: ignoring dirent '%.*s': inode_lookup(#%d) failed\n", name_len, name, ino);
+    return;
+  }
+  d.ino = ino_idx;
+  d.parent = parent_ino_idx;
+  i->dirent = dirents.bytes_used;
+
+  /* Fill in d.name + padd with zeros, aligning on 4 bytes */
+  memcpy(d.name, name, name_len);
+  padding = 4 - (name_len & 3);
+  for (p = 0; p < padding; p++)
+    d.name[name_len + p] = '\0';
+
+  dbg("  #%-8d i%-8d d%-8d  '%s'", ino, d.ino, i->dirent, d.name);
+  array_add(&dirents, &d, sizeof(struct dirent_empty_t) + name_len + padding);
+
+  /* The index stores inode numbers, not inodes[] indexes */
+  if (index_out) {
+    d.ino = ino;
+    d.parent = parent_ino;
+    index_add_dirent(&d, sizeof(struct dirent_empty_t) + name_len + padding);
+  }
+}
+
+int dirent_cb(struct ext2_dir_entry *dirent, int offset, int blocksize, char *buf, void *private) {
+  struct dirent_cb_t *cb;
+  char *name;
+  int name_len;
+  ext2_ino_t ino;
+
   cb = (struct dirent_cb_t *)private;
   ino = dirent->inode;
 
@@ -302,25 +1040,28 @@ int dirent_cb(struct ext2_dir_entry *dirent, int offset, int blocksize, char *bu
   if (ino == EXT2_ROOT_INO)
     name_len = 0;
 
-  i = inode_lookup(ino, &ino_idx);
-  if (!i) {
-    fprintf(stderr, "warning: ignoring dirent '%.*s': inode_lookup(#%d) failed\n", name_len, name, ino);
-    return 0;
-  }
-  d.ino = ino_idx;
-  d.parent = cb->parent_ino_idx;
-  i->dirent = dirents.bytes_used;
+  dirent_add(ino, name, name_len, cb->parent_ino, cb->parent_ino_idx);
+  return 0;
+}
 
-  /* Fill in d.name + padd with zeros, aligning on 4 bytes */
-  memcpy(d.name, name, name_len);
-  padding = 4 - (name_len & 3);
-  for (p = 0; p < padding; p++)
-    d.name[name_len + p] = '\0';
+/* Reuse the entries of an unchanged folder from the previous index. They are
+ * grouped by parent folder in inode order, as the pass 2 loop goes, thus we
+ * simply go on from where we stopped last time. */
+static size_t reuse_offset = 0;
 
-  dbg("  #%-8d i%-8d d%-8d  '%s'", ino, d.ino, i->dirent, d.name);
-  array_add(&dirents, &d, sizeof(struct dirent_empty_t) + name_len + padding);
+void reuse_dirents(ext2_ino_t parent_ino, unsigned int parent_ino_idx) {
+  while (reuse_offset < previous.header->dirents_bytes) {
+    struct dirent_t *d;
+    size_t name_len;
 
-  return 0;
+    d = (struct dirent_t *)(previous.dirents + reuse_offset);
+    if (d->parent > parent_ino)
+      break;
+    name_len = strlen(d->name);
+    if (d->parent == parent_ino)
+      dirent_add(d->ino, d->name, name_len, parent_ino, parent_ino_idx);
+    reuse_offset += sizeof(struct dirent_empty_t) + ((name_len + 4) & ~3);
+  }
 }
 
 
@@ -372,281 +1113,4775 @@ int dirent_to_path(struct dirent_t* d, char *path, int path_max) {
 }
 
 
-int main(int argc, char **argv) {
-  int opti = 0;
-  int optc;
-  int ret;
-  char *blkpath;
-  unsigned int scanned;
-  unsigned int used;
-  unsigned int selected;
-  char *anyp;
-  unsigned int index;
+/* jbd2 journal, read-only. We only need to walk its log and list which
+ * filesystem blocks have been logged by committed transactions : see the
+ * kernel's include/linux/jbd2.h for the on-disk format (big endian). */
+#define JBD2_MAGIC_NUMBER             0xc03b3998U
+#define JBD2_DESCRIPTOR_BLOCK         1
+#define JBD2_COMMIT_BLOCK             2
+#define JBD2_SUPERBLOCK_V1            3
+#define JBD2_SUPERBLOCK_V2            4
+#define JBD2_REVOKE_BLOCK             5
+#define JBD2_FEATURE_INCOMPAT_64BIT   0x02
+#define JBD2_FEATURE_INCOMPAT_CSUM_V2 0x08
+#define JBD2_FEATURE_INCOMPAT_CSUM_V3 0x10
+#define JBD2_FEATURE_INCOMPAT_FAST_COMMIT 0x20
+#define JBD2_DEFAULT_FAST_COMMIT_BLOCKS 256
+#define JBD2_FLAG_ESCAPE              1
+#define JBD2_FLAG_SAME_UUID           2
+#define JBD2_FLAG_LAST_TAG            8
 
-  while ((optc = getopt_long(argc, argv, "0a:cdhimpuv", optl, &opti)) != -1) {
-    switch (optc) {
-      case '0':
-        newline = '\0';
-        break;
-      case 'a':
-        if (!sscanf(optarg, "%u", &opt_after))
-          err(11, "--after: positive integer expected");
-        break;
-      case 'c':
-        opt_show_ctime = 1;
-        break;
-      case 'd':
-        opt_debug = 1;
-        break;
-      case 'h':
-        show_help();
-        exit(0);
-      case 'i':
-        opt_image = 1;
-        break;
-      case 'm':
-        opt_show_mtime = 1;
-        break;
-      case 'p':
-        opt_mountpoint = 1;
-        break;
-      case 'u':
-        opt_unique = 1;
-        break;
-      case 'v':
-        show_version();
-        exit(0);
-      case '?':
-        exit(10);
-    }
-  }
+struct journal_header_t {
+  __u32 h_magic;
+  __u32 h_blocktype;
+  __u32 h_sequence;
+};
 
-  if (optind >= argc)
-    err(1, "missing filesystem path or blockdev");
-  fspath = argv[optind];
+struct journal_superblock_t {
+  struct journal_header_t s_header;
+  __u32 s_blocksize;
+  __u32 s_maxlen;
+  __u32 s_first;
+  __u32 s_sequence;
+  __u32 s_start;
+  __u32 s_errno;
+  __u32 s_feature_compat;
+  __u32 s_feature_incompat;
+  __u32 s_feature_ro_compat;
+  __u8  s_uuid[16];
+  __u32 s_nr_users;
+  __u32 s_dynsuper;
+  __u32 s_max_transaction;
+  __u32 s_max_trans_data;
+  __u8  s_checksum_type;
+  __u8  s_padding2[3];
+  __u32 s_num_fc_blks;
+};
 
-  if (!opt_image && strncmp(fspath, "/dev/", 5) != 0) {
-    struct stat stat;
+struct journal_t {
+  ext2_ino_t        ino;
+  struct ext2_inode inode;
+  __u32             first;    /* First and last+1 log blocks */
+  __u32             last;
+  __u32             sequence; /* Oldest transaction in the log and its block */
+  __u32             start;    /* (0 if the log is empty) */
+  __u32             incompat;
+  int               tag_bytes;
+  char             *buf;
+};
 
-    dbg("'%s' does not look like a blkdev, calling blkid", fspath);
-    if (lstat(fspath, &stat) != 0)
-      err(3, "lstat(%s): %s", fspath, strerror(errno));
+static struct journal_t journal;
 
-    if (opt_mountpoint && stat.st_ino != EXT2_ROOT_INO)
-      err(9, "%s is not an ext2/3/4 mountpoint", fspath);
+/* A filesystem block logged by a committed transaction, and where its copy is
+ * in the log */
+struct journal_block_t {
+  blk64_t block;
+  __u32   log;
+  __u32   seq;
+  __u32   flags;
+};
 
-    blkpath = blkid_devno_to_devname(stat.st_dev);
-    if (!blkpath)
-      err(4, "blkid_devno_to_devname(%lu) failed", stat.st_dev);
-    dbg("'%s' mapped to blkdev '%s'", fspath, blkpath);
-    fspath = blkpath;
-  } else {
-    if (opt_mountpoint)
-      err(9, "%s is not an ext2/3/4 mountpoint", fspath);
-  }
+/* Transaction IDs wrap at 2^32 : compared as the kernel's tid_gt() and
+ * tid_geq() do */
+int tid_gt(__u32 a, __u32 b) {
+  return (__s32)(a - b) > 0;
+}
 
-  dbg("opening fs '%s'", fspath);
-  ret = ext2fs_open(fspath, 0, 0, 0, unix_io_manager, &fs);
+int tid_geq(__u32 a, __u32 b) {
+  return (__s32)(a - b) >= 0;
+}
+
+/* Fills in the journal struct. Returns 0 if there is no usable journal. */
+int journal_open() {
+  struct journal_superblock_t *jsb;
+  blk64_t pblk;
+  int ret;
+
+  journal.ino = fs->super->s_journal_inum;
+  if (!journal.ino || fs->super->s_journal_dev)
+    return 0; /* No journal, or external journal */
+  ret = ext2fs_read_inode(fs, journal.ino, &journal.inode);
   if (ret)
-    err(5, "ext2fs_open(%s): error %d", fspath, ret);
-  dbg("fs open: %d inodes, %d used (%.1f%%)",
-    fs->super->s_inodes_count,
-    fs->super->s_inodes_count - fs->super->s_free_inodes_count,
-    (fs->super->s_inodes_count - fs->super->s_free_inodes_count) * 100. / fs->super->s_inodes_count);
+    err(14, "ext2fs_read_inode(journal #%d): error %d", journal.ino, ret);
 
-  bitfield_init(&iisdir, fs->super->s_inodes_count);
-  bitfield_init(&iselect, fs->super->s_inodes_count);
-  /* No search criterion : pre-select everything. This bitfield is still useful
-   * for --unique deduplication. */
-  if (!opt_after)
-    bitfield_fill(iselect, fs->super->s_inodes_count, 1);
+  journal.buf = malloc(fs->blocksize);
+  if (!journal.buf)
+    err(6, "malloc(%d bytes) for journal block", fs->blocksize);
+  ret = ext2fs_bmap2(fs, journal.ino, &journal.inode, NULL, 0, 0, NULL, &pblk);
+  if (!ret)
+    ret = io_channel_read_blk64(fs->io, pblk, 1, journal.buf);
+  if (ret)
+    err(14, "reading journal superblock: error %d", ret);
 
-  array_init(&inodes);  /* Dynamically grows, no initial size */
-  array_init(&dirents); /* Dynamically grows, no initial size */
+  jsb = (struct journal_superblock_t *)journal.buf;
+  if (be32toh(jsb->s_header.h_magic) != JBD2_MAGIC_NUMBER ||
+      be32toh(jsb->s_blocksize) != fs->blocksize) {
+    fprintf(stderr, "warning: unsupported journal superblock\n");
+    return 0;
+  }
+  journal.first    = be32toh(jsb->s_first);
+  journal.last     = be32toh(jsb->s_maxlen);
+  journal.sequence = be32toh(jsb->s_sequence);
+  journal.start    = be32toh(jsb->s_start);
+  journal.incompat = be32toh(jsb->s_header.h_blocktype) == JBD2_SUPERBLOCK_V2 ? be32toh(jsb->s_feature_incompat) : 0;
+
+  /* Fast commit blocks are stored after the log, we ignore them */
+  if (journal.incompat & JBD2_FEATURE_INCOMPAT_FAST_COMMIT)
+    journal.last -= jsb->s_num_fc_blks ? be32toh(jsb->s_num_fc_blks) : JBD2_DEFAULT_FAST_COMMIT_BLOCKS;
+
+  /* See jbd2's journal_tag_bytes() */
+  if (journal.incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3)
+    journal.tag_bytes = 16;
+  else {
+    journal.tag_bytes = 12;
+    if (journal.incompat & JBD2_FEATURE_INCOMPAT_CSUM_V2)
+      journal.tag_bytes += 2;
+    if (!(journal.incompat & JBD2_FEATURE_INCOMPAT_64BIT))
+      journal.tag_bytes -= 4;
+  }
+  dbg("journal: #%d, log blocks %u-%u, oldest transaction %u at block %u", journal.ino,
+    journal.first, journal.last - 1, journal.sequence, journal.start);
+  return 1;
+}
+
+/* Reads log block #blk into journal.buf, returns its header if it belongs to
+ * the transaction #seq */
+struct journal_header_t * journal_read(__u32 blk, __u32 seq) {
+  struct journal_header_t *h;
+  blk64_t pblk;
+
+  if (ext2fs_bmap2(fs, journal.ino, &journal.inode, NULL, 0, blk, NULL, &pblk) || !pblk ||
+      io_channel_read_blk64(fs->io, pblk, 1, journal.buf))
+    return NULL;
+  h = (struct journal_header_t *)journal.buf;
+  if (be32toh(h->h_magic) != JBD2_MAGIC_NUMBER || be32toh(h->h_sequence) != seq)
+    return NULL;
+  return h;
+}
+
+__u32 journal_next(__u32 blk, __u32 count) {
+  blk += count;
+  while (blk >= journal.last)
+    blk -= journal.last - journal.first;
+  return blk;
+}
+
+/* Walks the log from block #blk where transaction #seq is expected, until the
+ * last committed transaction. func() is called with every filesystem block
+ * logged by transactions >= since. Returns the next transaction and the block
+ * where it is expected in *seq and *blk. */
+void journal_walk(__u32 *blk, __u32 *seq, __u32 since, void (*func)(struct journal_block_t *)) {
+  struct array logged; /* Array of journal_block_t, of the current transaction */
+  __u32 walked;
+
+  array_init(&logged);
+  for (walked = 0; walked < journal.last - journal.first; ) {
+    struct journal_header_t *h;
+    char *tag;
+    char *end;
+    size_t n;
+
+    h = journal_read(*blk, *seq);
+    if (!h)
+      break;
+
+    switch (be32toh(h->h_blocktype)) {
+      case JBD2_DESCRIPTOR_BLOCK:
+        /* Tags list the filesystem blocks logged in the next log blocks */
+        n = 0;
+        tag = journal.buf + sizeof(struct journal_header_t);
+        end = journal.buf + fs->blocksize;
+        if (journal.incompat & (JBD2_FEATURE_INCOMPAT_CSUM_V2 | JBD2_FEATURE_INCOMPAT_CSUM_V3))
+          end -= 4; /* Block tail checksum */
+        while (tag + journal.tag_bytes <= end) {
+          struct journal_block_t b;
+
+          b.block = be32toh(*(__u32 *)tag);
+          if (journal.incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3)
+            b.flags = be32toh(*(__u32 *)(tag + 4));
+          else
+            b.flags = be16toh(*(__u16 *)(tag + 6));
+          if (journal.incompat & JBD2_FEATURE_INCOMPAT_64BIT)
+            b.block |= (blk64_t)be32toh(*(__u32 *)(tag + 8)) << 32;
+          b.log = journal_next(*blk, 1 + n);
+          b.seq = *seq;
+          if (!array_add(&logged, &b, sizeof(b)))
+            err(6, "realloc() for journal blocks");
+          n++;
+
+          tag += journal.tag_bytes;
+          if (!(b.flags & JBD2_FLAG_SAME_UUID))
+            tag += 16;
+          if (b.flags & JBD2_FLAG_LAST_TAG)
+            break;
+        }
+        *blk = journal_next(*blk, 1 + n);
+        walked += 1 + n;
+        break;
+
+      case JBD2_COMMIT_BLOCK:
+        dbg("journal: transaction %u committed (%zu blocks)", *seq, logged.count);
+        if (func && tid_geq(*seq, since))
+          for (n = 0; n < logged.count; n++)
+            func((struct journal_block_t *)logged.buffer + n);
+        logged.count = logged.bytes_used = 0;
+        (*seq)++;
+        *blk = journal_next(*blk, 1);
+        walked++;
+        break;
+
+      case JBD2_REVOKE_BLOCK:
+        *blk = journal_next(*blk, 1);
+        walked++;
+        break;
+
+      default:
+        goto done;
+    }
+  }
+
+done:
+  /* An uncommitted transaction is ignored, it starts again at its descriptor */
+  free(logged.buffer);
+}
+
+/* Returns the next transaction id and its log block, or 0 if unknown */
+__u32 journal_head(__u32 *blk) {
+  __u32 seq;
+
+  if (!journal_open())
+    return 0;
+  seq = journal.sequence;
+  *blk = journal.start;
+  if (journal.start)
+    journal_walk(blk, &seq, seq, NULL);
+  else
+    *blk = journal.first; /* Empty log */
+  return seq;
+}
+
+/* Sorted inode table locations, to map a block to its inodes */
+struct itable_t {
+  blk64_t block;
+  dgrp_t  group;
+};
+static struct itable_t *itables;
+
+/* Logged inode table blocks, sorted by block : only the newest copy of each.
+ * A committed transaction may not have been checkpointed yet, its inodes must
+ * then be read from the log rather than from the inode table. Revoke records
+ * are ignored : inode table blocks are never freed. */
+static struct array journal_copies; /* Array of journal_block_t */
+static char *journal_copy_buf = NULL;
+static struct journal_block_t *journal_copy_cached = NULL; /* In journal_copy_buf */
+
+int journal_block_cmp(const void *a, const void *b) {
+  const struct journal_block_t *ja = a;
+  const struct journal_block_t *jb = b;
+
+  if (ja->block != jb->block)
+    return ja->block < jb->block ? -1 : 1;
+  return tid_gt(jb->seq, ja->seq) ? -1 : tid_gt(ja->seq, jb->seq);
+}
+
+int itable_cmp(const void *a, const void *b) {
+  blk64_t ba = ((struct itable_t *)a)->block;
+  blk64_t bb = ((struct itable_t *)b)->block;
+
+  return ba < bb ? -1 : ba > bb;
+}
+
+/* journal_walk() callback : mark the inodes of a logged inode table block */
+void journal_mark_block(struct journal_block_t *b) {
+  blk64_t block = b->block;
+  struct itable_t key;
+  struct itable_t *it;
+  size_t lo, hi;
+  ext2_ino_t ino, per_block;
+
+  /* Last itable starting at or before block */
+  key.block = block;
+  for (lo = 0, hi = fs->group_desc_count; lo < hi; ) {
+    size_t mid = (lo + hi) / 2;
+
+    if (itable_cmp(&itables[mid], &key) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return;
+  it = &itables[lo - 1];
+  if (block >= it->block + fs->inode_blocks_per_group)
+    return; /* Not an inode table block */
+
+  per_block = fs->blocksize / fs->super->s_inode_size;
+  ino = it->group * fs->super->s_inodes_per_group + (block - it->block) * per_block + 1;
+  dbg("journal: block %llu is inode table of group %d (#%d-#%d)", (unsigned long long)block, it->group, ino, ino + per_block - 1);
+  for (; per_block--; ino++)
+    bitfield_set(ijournal, ino);
+  bitfield_set(gjournal, it->group);
+  if (!array_add(&journal_copies, b, sizeof(*b)))
+    err(6, "realloc() for journal blocks");
+}
+
+int journal_copy_cmp(const void *a, const void *b) {
+  blk64_t ba = ((struct journal_block_t *)a)->block;
+  blk64_t bb = ((struct journal_block_t *)b)->block;
+
+  return ba < bb ? -1 : ba > bb;
+}
+
+/* Keeps the newest copy of each logged block */
+void journal_copies_sort() {
+  struct journal_block_t *c = (struct journal_block_t *)journal_copies.buffer;
+  size_t n, kept;
+
+  qsort(c, journal_copies.count, sizeof(*c), journal_block_cmp);
+  for (n = 0, kept = 0; n < journal_copies.count; n++) {
+    if (kept && c[kept - 1].block == c[n].block)
+      kept--;
+    c[kept++] = c[n];
+  }
+  journal_copies.count = kept;
+  journal_copies.bytes_used = kept * sizeof(*c);
+  dbg("journal: %zu inode table blocks logged", kept);
+}
+
+/* Reads an inode from the newest logged copy of its inode table block.
+ * Returns 0 if the block has not been logged, -1 on read error. */
+int journal_inode(ext2_ino_t ino, struct ext2_inode_large *inode) {
+  struct journal_block_t key;
+  struct journal_block_t *c;
+  dgrp_t group = (ino - 1) / fs->super->s_inodes_per_group;
+  ext2_ino_t index = (ino - 1) % fs->super->s_inodes_per_group;
+  ext2_ino_t per_block = fs->blocksize / fs->super->s_inode_size;
+  size_t size;
+
+  key.block = ext2fs_inode_table_loc(fs, group) + index / per_block;
+  c = journal_copy_cached;
+  if (!c || c->block != key.block) {
+    blk64_t pblk;
+
+    c = bsearch(&key, journal_copies.buffer, journal_copies.count, sizeof(key), journal_copy_cmp);
+    if (!c)
+      return 0;
+    if (!journal_copy_buf && !(journal_copy_buf = malloc(fs->blocksize)))
+      err(6, "malloc() for journal block");
+    journal_copy_cached = NULL;
+    if (ext2fs_bmap2(fs, journal.ino, &journal.inode, NULL, 0, c->log, NULL, &pblk) || !pblk ||
+        io_channel_read_blk64(fs->io, pblk, 1, journal_copy_buf))
+      return -1;
+    if (c->flags & JBD2_FLAG_ESCAPE)
+      *(__u32 *)journal_copy_buf = htobe32(JBD2_MAGIC_NUMBER);
+    journal_copy_cached = c;
+  }
+
+  size = fs->super->s_inode_size < sizeof(*inode) ? fs->super->s_inode_size : sizeof(*inode);
+  memset(inode, 0, sizeof(*inode));
+  memcpy(inode, journal_copy_buf + (index % per_block) * fs->super->s_inode_size, size);
+  return 1;
+}
+
+/* Marks the inodes whose inode table block has been logged since transaction
+ * #since. The walk may start from where the index says the transaction is
+ * expected, or from the oldest transaction still in the log. */
+void journal_mark(__u32 since) {
+  __u32 blk;
+  __u32 seq;
+  dgrp_t group;
+
+  if (!journal_open())
+    err(14, "--journal: no usable internal journal");
+
+  itables = malloc(fs->group_desc_count * sizeof(struct itable_t));
+  if (!itables)
+    err(6, "malloc() for inode table locations");
+  for (group = 0; group < fs->group_desc_count; group++) {
+    itables[group].block = ext2fs_inode_table_loc(fs, group);
+    itables[group].group = group;
+  }
+  qsort(itables, fs->group_desc_count, sizeof(struct itable_t), itable_cmp);
+  bitfield_init(&ijournal, fs->super->s_inodes_count + 1);
+  bitfield_init(&gjournal, fs->group_desc_count);
+  array_init(&journal_copies);
+
+  blk = previous.header->journal_block;
+  seq = since;
+  if (since == previous.header->journal_seq && journal_read(blk, seq)) {
+    dbg("journal: transaction %u found where expected (block %u)", seq, blk);
+    journal_walk(&blk, &seq, since, journal_mark_block);
+  } else if (journal.start && tid_geq(since, journal.sequence)) {
+    dbg("journal: walking from oldest transaction %u", journal.sequence);
+    blk = journal.start;
+    seq = journal.sequence;
+    journal_walk(&blk, &seq, since, journal_mark_block);
+  } else if (!journal.start && journal.sequence == since) {
+    dbg("journal: empty log, nothing logged since transaction %u", since);
+    blk = journal.first;
+  } else
+    err(14, "--journal: transaction %u is not in the journal anymore, an --incremental scan is needed", since);
+
+  if (tid_gt(since, seq))
+    err(14, "--journal: transaction %u has not been logged yet (next is %u)", since, seq);
+  journal_copies_sort();
+  dbg("journal: next transaction %u at block %u", seq, blk);
+  if (index_out) {
+    index_out_header.journal_seq   = seq;
+    index_out_header.journal_block = blk;
+  }
+}
+
+
+int inode_meta_cmp(const void *a, const void *b) {
+  ext2_ino_t ia = ((struct inode_meta_t *)a)->ino;
+  ext2_ino_t ib = ((struct inode_meta_t *)b)->ino;
+
+  return ia < ib ? -1 : ia > ib;
+}
+
+struct inode_meta_t * index_inode_lookup(struct index_t *idx, ext2_ino_t ino) {
+  struct inode_meta_t key;
+
+  key.ino = ino;
+  return bsearch(&key, idx->inodes, idx->header->inodes, sizeof(key), inode_meta_cmp);
+}
+
+/* A folder's entries may be reused from the previous index if its inode did
+ * not change. Its times must also be older than the previous scan : a change
+ * happening within the same second as the scan would go unnoticed. */
+int dir_unchanged(struct inode_meta_t *m) {
+  struct inode_meta_t *p;
+
+  p = index_inode_lookup(&previous, m->ino);
+  return p && LINUX_S_ISDIR(p->mode) &&
+    p->generation == m->generation &&
+    p->mtime == m->mtime && p->ctime == m->ctime && p->size == m->size &&
+    TIME_SEC(p->mtime) < (long long)previous.header->time && TIME_SEC(p->ctime) < (long long)previous.header->time;
+}
+
+/* --journal : an inode logged in the journal may have been written for
+ * another inode of the same block, compare it with the previous index. */
+int journal_changed(struct inode_meta_t *m) {
+  struct inode_meta_t *p;
+
+  if (!bitfield_get(ijournal, m->ino))
+    return 0;
+  p = index_inode_lookup(&previous, m->ino);
+  return !p || p->generation != m->generation ||
+    p->mtime != m->mtime || p->ctime != m->ctime || p->size != m->size;
+}
+
+/* --resolve-inodes : reads the inode numbers to be shown from stdin */
+void resolve_inodes_read() {
+  char word[32];
+  unsigned long ino;
+  char *end;
+  size_t count = 0;
+
+  bitfield_init(&iwanted, fs->super->s_inodes_count + 1);
+  while (scanf("%31s", word) == 1) {
+    ino = strtoul(word, &end, 10);
+    if (*end || ino < 1 || ino > fs->super->s_inodes_count) {
+      fprintf(stderr, "warning: --resolve-inodes: ignoring '%s'\n", word);
+      continue;
+    }
+    bitfield_set(iwanted, ino);
+    count++;
+  }
+  dbg("%zu inodes to resolve", count);
+}
+
+void resolve_inodes_check() {
+  ext2_ino_t ino;
+
+  for (ino = 1; ino <= fs->super->s_inodes_count; ino++)
+    if (bitfield_get(iwanted, ino) && !bitfield_get(iselect, ino))
+      fprintf(stderr, "warning: inode #%d is not in use\n", ino);
+}
+
+/* --filter : a find-like expression, compiled once into a postfix program
+ * which is run on every used inode of pass 1. Tests push a bit on a 64 bits
+ * stack, operators combine the top bits :
+ *
+ *   expr := and ('or' and)*
+ *   and  := not (['and'] not)*
+ *   not  := 'not' not | '(' expr ')' | test
+ *   test := 'type' f,d,l,c,b,p,s | FIELD OP VALUE | 'perm' [-/]OCTAL
+ *         | 'flag' NAME | 'after' TIME
+ *
+ * FIELD is size, blocks, uid, gid, links, ino, mtime, ctime, atime or crtime,
+ * OP is <, <=, >, >=, = or !=. Values take k, M, G, T suffixes (powers of
+ * 1024), times are epochs or durations ago (s, m, h, d, w suffixes).
+ */
+#define FILTER_CMP   1
+#define FILTER_TYPE  2
+#define FILTER_PERM  3 /* Exact mode bits */
+#define FILTER_PERMA 4 /* All of the bits */
+#define FILTER_PERMY 5 /* Any of the bits */
+#define FILTER_FLAG  6
+#define FILTER_AFTER 7
+#define FILTER_NOT   8
+#define FILTER_AND   9
+#define FILTER_OR    10
+
+#define FILTER_DEPTH 64
+
+struct filter_op_t {
+  __u8  op;
+  __u8  field; /* FILTER_CMP : offset in inode_meta_t, see filter_fields[] */
+  __u8  size;  /* FILTER_CMP : field size in bytes */
+  __u8  cmp;   /* FILTER_CMP : '<', 'l' (<=), '>', 'g' (>=), '=' or '!' */
+  __u64 value;
+};
+
+struct filter_field_t {
+  const char *name;
+  size_t      offset;
+  size_t      size;
+  int         time;
+};
+
+static const struct filter_field_t filter_fields[] = {
+  { "size",   offsetof(struct inode_meta_t, size),   8, 0 },
+  { "blocks", offsetof(struct inode_meta_t, blocks), 8, 0 },
+  { "uid",    offsetof(struct inode_meta_t, uid),    4, 0 },
+  { "gid",    offsetof(struct inode_meta_t, gid),    4, 0 },
+  { "links",  offsetof(struct inode_meta_t, links),  2, 0 },
+  { "ino",    offsetof(struct inode_meta_t, ino),    4, 0 },
+  { "mtime",  offsetof(struct inode_meta_t, mtime),  8, 1 },
+  { "ctime",  offsetof(struct inode_meta_t, ctime),  8, 1 },
+  { "atime",  offsetof(struct inode_meta_t, atime),  8, 1 },
+  { "crtime", offsetof(struct inode_meta_t, crtime), 8, 1 },
+  { NULL, 0, 0, 0 }
+};
+
+static const struct { const char *name; __u32 flag; } filter_flags[] = {
+  { "immutable", EXT2_IMMUTABLE_FL },
+  { "append",    EXT2_APPEND_FL },
+  { "nodump",    EXT2_NODUMP_FL },
+  { "noatime",   EXT2_NOATIME_FL },
+  { "index",     EXT2_INDEX_FL },
+  { "extents",   EXT4_EXTENTS_FL },
+  { "inline",    EXT4_INLINE_DATA_FL },
+  { "encrypt",   EXT4_ENCRYPT_FL },
+  { NULL, 0 }
+};
+
+static struct array filter;       /* Array of filter_op_t */
+static const char *filter_expr;   /* Being compiled */
+static char filter_token[64];
+static int filter_depth;
+static time_t filter_now;
+
+/* Next token : a parenthesis, an operator, or a word */
+const char * filter_next() {
+  size_t len = 0;
+
+  while (*filter_expr == ' ' || *filter_expr == '\t')
+    filter_expr++;
+  if (*filter_expr == '(' || *filter_expr == ')')
+    filter_token[len++] = *filter_expr++;
+  else if (strchr("<>=!", *filter_expr) && *filter_expr)
+    while (*filter_expr && strchr("<>=!", *filter_expr) && len < sizeof(filter_token) - 1)
+      filter_token[len++] = *filter_expr++;
+  else
+    while (*filter_expr && !strchr(" \t()<>=!", *filter_expr) && len < sizeof(filter_token) - 1)
+      filter_token[len++] = *filter_expr++;
+  filter_token[len] = '\0';
+  return filter_token;
+}
+
+const char * filter_peek() {
+  const char *saved = filter_expr;
+  const char *token = filter_next();
+
+  filter_expr = saved;
+  return token;
+}
+
+void filter_emit(int op, int field, int size, int cmp, __u64 value) {
+  struct filter_op_t o;
+
+  o.op    = op;
+  o.field = field;
+  o.size  = size;
+  o.cmp   = cmp;
+  o.value = value;
+  if (!array_add(&filter, &o, sizeof(o)))
+    err(6, "realloc() for --filter");
+  if (op <= FILTER_AFTER && ++filter_depth > FILTER_DEPTH)
+    err(11, "--filter: expression too deep");
+  if (op == FILTER_AND || op == FILTER_OR)
+    filter_depth--;
+}
+
+__u64 filter_value(const char *word, int time) {
+  unsigned long long v;
+  __u32 ns = 0;
+  __u32 digit;
+  char *end;
+
+  /* strtoull() would take a sign, and saturates */
+  errno = 0;
+  v = strtoull(word, &end, 10);
+  if (*word < '0' || *word > '9' || errno)
+    err(11, "--filter: number expected instead of '%s'", word);
+  if (time && v > 0x37fffffffULL) /* Up to 2446, as ext4 */
+    err(11, "--filter: time out of range '%s'", word);
+  if (!*end)
+    return time ? TIME_PACK(v, 0) : v;
+  if (time && *end == '.') {
+    /* Epoch with a fraction, down to the nanosecond */
+    for (end++, digit = 100000000; *end >= '0' && *end <= '9'; end++, digit /= 10)
+      ns += (*end - '0') * digit;
+    if (!*end)
+      return TIME_PACK(v, ns);
+  } else if (!end[1] && time && strchr("smhdw", *end)) {
+    /* Duration ago, which must not go before the epoch */
+    unsigned long long unit = *end == 's' ? 1 : *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 7 * 86400;
+
+    if (v > (unsigned long long)filter_now / unit)
+      err(11, "--filter: duration too long '%s'", word);
+    return TIME_PACK(filter_now - v * unit, 0);
+  } else if (!end[1] && !time && strchr("kMGT", *end)) {
+    int shift = *end == 'k' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 40;
+
+    if (v >> (64 - shift))
+      err(11, "--filter: value out of range '%s'", word);
+    return v << shift;
+  }
+  err(11, "--filter: bad value '%s'", word);
+}
+
+void filter_or();
+
+void filter_test() {
+  char word[sizeof(filter_token)];
+  const char *arg;
+  int n;
+
+  strcpy(word, filter_next());
+  if (strcmp(word, "(") == 0) {
+    filter_or();
+    if (strcmp(filter_next(), ")") != 0)
+      err(11, "--filter: ')' expected");
+    return;
+  }
+  if (strcmp(word, "not") == 0) {
+    filter_test();
+    filter_emit(FILTER_NOT, 0, 0, 0, 0);
+    return;
+  }
+
+  if (strcmp(word, "type") == 0) {
+    __u64 mask = 0;
+
+    /* Bit n is set for the file types n << 12 */
+    for (arg = filter_next(); *arg; arg++)
+      switch (*arg) {
+        case 'f': mask |= 1 << (LINUX_S_IFREG >> 12);  break;
+        case 'd': mask |= 1 << (LINUX_S_IFDIR >> 12);  break;
+        case 'l': mask |= 1 << (LINUX_S_IFLNK >> 12);  break;
+        case 'c': mask |= 1 << (LINUX_S_IFCHR >> 12);  break;
+        case 'b': mask |= 1 << (LINUX_S_IFBLK >> 12);  break;
+        case 'p': mask |= 1 << (LINUX_S_IFIFO >> 12);  break;
+        case 's': mask |= 1 << (LINUX_S_IFSOCK >> 12); break;
+        case ',': break;
+        default: err(11, "--filter: unknown type '%c'", *arg);
+      }
+    if (!mask)
+      err(11, "--filter: file type expected after 'type'");
+    filter_emit(FILTER_TYPE, 0, 0, 0, mask);
+    return;
+  }
+  if (strcmp(word, "perm") == 0) {
+    int op = FILTER_PERM;
+    unsigned long mode;
+    char *end;
+
+    arg = filter_next();
+    if (*arg == '-' || *arg == '/')
+      op = *arg++ == '-' ? FILTER_PERMA : FILTER_PERMY;
+    mode = strtoul(arg, &end, 8);
+    if (*arg < '0' || *arg > '7' || *end || mode > 07777)
+      err(11, "--filter: octal mode expected instead of '%s'", arg);
+    filter_emit(op, 0, 0, 0, mode);
+    return;
+  }
+  if (strcmp(word, "flag") == 0) {
+    arg = filter_next();
+    for (n = 0; filter_flags[n].name && strcmp(filter_flags[n].name, arg) != 0; n++)
+      ;
+    if (!filter_flags[n].name)
+      err(11, "--filter: unknown flag '%s'", arg);
+    filter_emit(FILTER_FLAG, 0, 0, 0, filter_flags[n].flag);
+    return;
+  }
+  if (strcmp(word, "after") == 0) {
+    filter_emit(FILTER_AFTER, 0, 0, 0, filter_value(filter_next(), 1));
+    return;
+  }
+
+  for (n = 0; filter_fields[n].name && strcmp(filter_fields[n].name, word) != 0; n++)
+    ;
+  if (!filter_fields[n].name)
+    err(11, "--filter: unknown test '%s'", word);
+  arg = filter_next();
+  if      (strcmp(arg, "<") == 0)  word[0] = '<';
+  else if (strcmp(arg, "<=") == 0) word[0] = 'l';
+  else if (strcmp(arg, ">") == 0)  word[0] = '>';
+  else if (strcmp(arg, ">=") == 0) word[0] = 'g';
+  else if (strcmp(arg, "=") == 0)  word[0] = '=';
+  else if (strcmp(arg, "!=") == 0) word[0] = '!';
+  else
+    err(11, "--filter: comparison expected after '%s'", filter_fields[n].name);
+  filter_emit(FILTER_CMP, filter_fields[n].offset, filter_fields[n].size, word[0],
+    filter_value(filter_next(), filter_fields[n].time));
+}
+
+void filter_and() {
+  const char *next;
+
+  filter_test();
+  for (next = filter_peek(); *next && strcmp(next, "or") != 0 && strcmp(next, ")") != 0; next = filter_peek()) {
+    if (strcmp(next, "and") == 0)
+      filter_next();
+    filter_test();
+    filter_emit(FILTER_AND, 0, 0, 0, 0);
+  }
+}
+
+void filter_or() {
+  filter_and();
+  while (strcmp(filter_peek(), "or") == 0) {
+    filter_next();
+    filter_and();
+    filter_emit(FILTER_OR, 0, 0, 0, 0);
+  }
+}
+
+/* Compiles an expression, and-ed with the previous ones */
+void filter_compile(const char *expr) {
+  int first = filter.count == 0;
+
+  if (first)
+    array_init(&filter);
+  filter_now = time(NULL);
+  filter_expr = expr;
+  filter_or();
+  if (*filter_next())
+    err(11, "--filter: unexpected '%s'", filter_token);
+  if (!first)
+    filter_emit(FILTER_AND, 0, 0, 0, 0);
+  dbg("--filter: %zu operations", filter.count);
+}
+
+int filter_eval(struct inode_meta_t *m) {
+  struct filter_op_t *o = (struct filter_op_t *)filter.buffer;
+  struct filter_op_t *end = o + filter.count;
+  __u64 stack = 0; /* The top is bit 0 */
+  __u64 v;
+  int b = 0;
+
+  for (; o < end; o++) {
+    switch (o->op) {
+      case FILTER_CMP:
+        if (o->size == 8)
+          v = *(__u64 *)((char *)m + o->field);
+        else if (o->size == 4)
+          v = *(__u32 *)((char *)m + o->field);
+        else
+          v = *(__u16 *)((char *)m + o->field);
+        switch (o->cmp) {
+          case '<': b = v <  o->value; break;
+          case 'l': b = v <= o->value; break;
+          case '>': b = v >  o->value; break;
+          case 'g': b = v >= o->value; break;
+          case '=': b = v == o->value; break;
+          case '!': b = v != o->value; break;
+        }
+        break;
+      case FILTER_TYPE:
+        b = (o->value >> ((m->mode & LINUX_S_IFMT) >> 12)) & 1;
+        break;
+      case FILTER_PERM:
+        b = (m->mode & 07777) == o->value;
+        break;
+      case FILTER_PERMA:
+        b = (m->mode & o->value) == o->value;
+        break;
+      case FILTER_PERMY:
+        b = (m->mode & o->value) != 0;
+        break;
+      case FILTER_FLAG:
+        b = (m->flags & o->value) != 0;
+        break;
+      case FILTER_AFTER:
+        b = m->mtime >= o->value || m->ctime >= o->value;
+        break;
+      case FILTER_NOT:
+        stack ^= 1;
+        continue;
+      case FILTER_AND:
+        stack = (stack >> 1) & (stack | ~1ULL);
+        continue;
+      case FILTER_OR:
+        stack = (stack >> 1) | (stack & 1);
+        continue;
+    }
+    stack = stack << 1 | b;
+  }
+  return stack & 1;
+}
+
+/* Search criterions, evaluated on every used inode */
+int inode_match(struct inode_meta_t *m) {
+  if (isubtree && !bitfield_get(isubtree, m->ino))
+    return 0; /* Ancestor of --subtree */
+  if (iwanted && !bitfield_get(iwanted, m->ino))
+    return 0;
+  if (opt_sum && !LINUX_S_ISREG(m->mode))
+    return 0;
+  if (opt_du && !LINUX_S_ISDIR(m->mode))
+    return 0;
+  if (filter.count && !filter_eval(m))
+    return 0;
+  if (ijournal && !journal_changed(m))
+    return 0;
+  return 1;
+}
+
+/* Devices, fifos, sockets, inline data and fast symlinks have no blocks */
+int inode_has_blocks(struct ext2_inode_large *inode) {
+  if (!LINUX_S_ISREG(inode->i_mode) && !LINUX_S_ISDIR(inode->i_mode) && !LINUX_S_ISLNK(inode->i_mode))
+    return 0;
+  return !(inode->i_flags & EXT4_INLINE_DATA_FL) && !ext2fs_is_fast_symlink((struct ext2_inode *)inode);
+}
+
+/* First physical block, as told by the inode itself : the first extent of the
+ * extent root, or the first extent block of a deeper tree (allocated next to
+ * the data), or the first block map entry. */
+__u64 inode_first_block(struct ext2_inode_large *inode) {
+  struct ext3_extent_header *eh;
+
+  if (!inode_has_blocks(inode))
+    return 0;
+  if (!(inode->i_flags & EXT4_EXTENTS_FL))
+    return inode->i_block[0];
+
+  eh = (struct ext3_extent_header *)inode->i_block;
+  if (le16toh(eh->eh_magic) != EXT3_EXT_MAGIC || le16toh(eh->eh_entries) == 0)
+    return 0;
+  if (le16toh(eh->eh_depth) == 0) {
+    struct ext3_extent *ex = (struct ext3_extent *)(eh + 1);
+
+    return le32toh(ex->ee_start) | (__u64)le16toh(ex->ee_start_hi) << 32;
+  } else {
+    struct ext3_extent_idx *ix = (struct ext3_extent_idx *)(eh + 1);
+
+    return le32toh(ix->ei_leaf) | (__u64)le16toh(ix->ei_leaf_hi) << 32;
+  }
+}
+
+/* Fill in a inode_meta_t from an on-disk inode. The extra fields of large
+ * inodes are only used if present. */
+#define inode_has_extra(inode, field) \
+  (fs->super->s_inode_size > EXT2_GOOD_OLD_INODE_SIZE && \
+   (inode)->i_extra_isize >= offsetof(struct ext2_inode_large, field) + sizeof((inode)->field) - EXT2_GOOD_OLD_INODE_SIZE)
+
+/* Large inodes extend times with 2 more bits of seconds (up to 2446) and the
+ * nanoseconds, see the kernel's ext4_decode_extra_time() */
+__u64 inode_time(__u32 time, __u32 extra, int has_extra) {
+  long long sec = (__s32)time;
+
+  if (!has_extra)
+    return TIME_PACK(sec, 0);
+  sec += (long long)(extra & 3) << 32;
+  return TIME_PACK(sec, extra >> 2);
+}
+
+void inode_meta_fill(ext2_ino_t ino, struct ext2_inode_large *inode, struct inode_meta_t *m) {
+  m->ino         = ino;
+  m->mode        = inode->i_mode;
+  m->links       = inode->i_links_count;
+  m->uid         = inode_uid(*inode);
+  m->gid         = inode_gid(*inode);
+  m->flags       = inode->i_flags;
+  m->generation  = inode->i_generation;
+  m->atime       = inode_time(inode->i_atime, inode->i_atime_extra, inode_has_extra(inode, i_atime_extra));
+  m->ctime       = inode_time(inode->i_ctime, inode->i_ctime_extra, inode_has_extra(inode, i_ctime_extra));
+  m->mtime       = inode_time(inode->i_mtime, inode->i_mtime_extra, inode_has_extra(inode, i_mtime_extra));
+  m->crtime      = inode_has_extra(inode, i_crtime) ?
+    inode_time(inode->i_crtime, inode->i_crtime_extra, inode_has_extra(inode, i_crtime_extra)) : TIME_PACK(0, 0);
+  m->size        = EXT2_I_SIZE(inode);
+  m->blocks      = ext2fs_get_stat_i_blocks(fs, (struct ext2_inode *)inode);
+  m->first_block = inode_first_block(inode);
+}
+
+/* Top-N : a min-heap of the N largest keys seen so far, its root is the next
+ * one to be evicted */
+struct top_t {
+  __u64        key;
+  unsigned int idx;
+};
+
+static struct top_t *top = NULL;
+static size_t top_count = 0;
+static size_t top_max = 0;
+
+void top_add(__u64 key, unsigned int idx) {
+  size_t n, c;
+
+  if (top_count < top_max) {
+    for (n = top_count++; n && top[(n - 1) / 2].key > key; n = (n - 1) / 2)
+      top[n] = top[(n - 1) / 2];
+  } else if (top_max && key > top[0].key) {
+    for (n = 0; (c = 2 * n + 1) < top_count; n = c) {
+      if (c + 1 < top_count && top[c + 1].key < top[c].key)
+        c++;
+      if (top[c].key >= key)
+        break;
+      top[n] = top[c];
+    }
+  } else
+    return;
+  top[n].key = key;
+  top[n].idx = idx;
+}
+
+/* Largest first */
+int top_cmp(const void *a, const void *b) {
+  const struct top_t *ta = a;
+  const struct top_t *tb = b;
+
+  if (ta->key != tb->key)
+    return ta->key > tb->key ? -1 : 1;
+  return ta->idx < tb->idx ? -1 : ta->idx > tb->idx;
+}
+
+/* --top : only the winners of pass 1 are kept for pass 2 */
+void top_select() {
+  size_t n;
+
+  bitfield_fill(iselect, fs->super->s_inodes_count, 0);
+  for (n = 0; n < top_count; n++)
+    bitfield_set(iselect, ((struct inode_t *)(inodes.buffer + inodes_elsize * top[n].idx))->ino);
+}
+
+struct usage_t * usage_get(struct array *a, __u32 id) {
+  struct usage_t *u = (struct usage_t *)a->buffer;
+  struct usage_t empty;
+  size_t lo, hi;
+
+  for (lo = 0, hi = a->count; lo < hi; ) {
+    size_t mid = (lo + hi) / 2;
+
+    if (u[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < a->count && u[lo].id == id)
+    return &u[lo];
+
+  /* New ids are rare, insert in place */
+  memset(&empty, 0, sizeof(empty));
+  if (!array_add(a, &empty, sizeof(empty)))
+    err(6, "realloc() for --usage");
+  u = (struct usage_t *)a->buffer;
+  memmove(&u[lo + 1], &u[lo], (a->count - 1 - lo) * sizeof(*u));
+  u[lo].id = id;
+  return &u[lo];
+}
+
+void usage_sum(struct usage_t *u, struct inode_meta_t *m) {
+  u->size   += m->size;
+  u->blocks += m->blocks;
+  u->count++;
+}
+
+/* Pass 1 : a selected inode */
+void usage_add(struct inode_meta_t *m) {
+  time_t age;
+  int n;
+
+  usage_sum(usage_get(&usage_uids, m->uid), m);
+  usage_sum(usage_get(&usage_gids, m->gid), m);
+  age = usage_now - TIME_SEC(m->mtime);
+  for (n = 0; n < USAGE_AGES - 1 && age >= usage_age_max[n]; n++)
+    ;
+  usage_sum(&usage_ages[n], m);
+}
+
+/* Pass 1 : a selected inode */
+void count_add(struct inode_meta_t *m) {
+  struct count_t *c;
+  int type;
+  int n;
+
+  if (LINUX_S_ISREG(m->mode))       type = 0;
+  else if (LINUX_S_ISDIR(m->mode))  type = 1;
+  else if (LINUX_S_ISLNK(m->mode))  type = 2;
+  else if (LINUX_S_ISCHR(m->mode))  type = 3;
+  else if (LINUX_S_ISBLK(m->mode))  type = 4;
+  else if (LINUX_S_ISFIFO(m->mode)) type = 5;
+  else if (LINUX_S_ISSOCK(m->mode)) type = 6;
+  else                              type = 7;
+  c = &count_types[type];
+  c->count++;
+  c->size   += m->size;
+  c->blocks += m->blocks;
+
+  for (n = 0; n < COUNT_LINKS - 1 && m->links > 1U << n; n++)
+    ;
+  count_links[n]++;
+}
+
+void count_vector(double *v) {
+  int k = 3;
+  int n;
+
+  v[0] = v[1] = v[2] = 0;
+  for (n = 0; n < COUNT_TYPES; n++) {
+    v[0] += v[k++] = count_types[n].count;
+    v[1] += v[k++] = count_types[n].size;
+    v[2] += v[k++] = count_types[n].blocks;
+  }
+  for (n = 0; n < COUNT_LINKS; n++)
+    v[k++] = count_links[n];
+}
+
+void count_unvector(double *v) {
+  int k = 3;
+  int n;
+
+  for (n = 0; n < COUNT_TYPES; n++) {
+    count_types[n].count  = llround(v[k++]);
+    count_types[n].size   = llround(v[k++]);
+    count_types[n].blocks = llround(v[k++]);
+  }
+  for (n = 0; n < COUNT_LINKS; n++)
+    count_links[n] = llround(v[k++]);
+}
+
+/* Only the filters need pass 1, otherwise --count is answered from the group
+ * descriptors */
+int scan_filtered() {
+  return filter.count || opt_journal || opt_resolve_inodes || opt_subtree;
+}
+
+/* Passes 2 and 3 are not needed by the reports made from pass 1 alone */
+int scan_dirents() {
+  if (opt_save_index || opt_diff)
+    return 1;
+  return !opt_count && opt_usage != USAGE_INODES;
+}
+
+/* Record a used inode. This is the common path for inodes read from an inode
+ * table and inodes reused from a previous index. Fills in :
+ *
+ * - inodes[]  : one inode_t per used inode, sorted by inode number
+ * - iisdir[]  : set for folders
+ * - iselect[] : set for inodes matching the search criterions
+ * - idirkeep[] : set for folders which did not change since the previous index
+ *
+ * Returns whether it matches the search criterions.
+ */
+int inode_add(struct inode_meta_t *m) {
+  union {
+    struct inode_t i;
+    __u64          align[(sizeof(struct inode_t) + INODE_FIELDS_BYTES) / 8];
+  } r;
+  int match;
+  int n;
+
+  if (LINUX_S_ISDIR(m->mode)) {
+    bitfield_set(iisdir, m->ino);
+    if (previous.map && dir_unchanged(m))
+      bitfield_set(idirkeep, m->ino);
+  }
+  match = inode_match(m);
+  if (match && !opt_resolve_blocks) /* Otherwise see blocks_check() */
+    bitfield_set(iselect, m->ino);
+  if (bitfield_get(iselect, m->ino))
+    inodes_selected++;
+
+  r.i.ino = m->ino;
+  r.i.dirent = 0;
+  for (n = 0; n < FIELDS; n++) {
+    if (inode_fields_at[n] < 0)
+      continue;
+    if (inode_fields[n].seconds) {
+      __s64 sec = TIME_SEC(*(__u64 *)((char *)m + inode_fields[n].offset));
+
+      memcpy(r.i.fields + inode_fields_at[n], &sec, 8);
+    } else
+      memcpy(r.i.fields + inode_fields_at[n], (char *)m + inode_fields[n].offset, inode_fields[n].size);
+  }
+  dbg("+%8d #%8d", inodes_used, m->ino);
+  array_add(&inodes, &r, inodes_elsize);
+  if (opt_block_order)
+    array_add(&first_blocks, &m->first_block, sizeof(m->first_block));
+  if (opt_top && !opt_du && bitfield_get(iselect, m->ino) && !LINUX_S_ISDIR(m->mode))
+    top_add(opt_top_by == TOP_SIZE ? m->size : m->blocks, inodes.count - 1);
+  if (opt_usage && bitfield_get(iselect, m->ino))
+    usage_add(m);
+  if (opt_count && bitfield_get(iselect, m->ino))
+    count_add(m);
+  if (opt_du || opt_ncdu || opt_usage == USAGE_DIRS) {
+    struct du_t du = { m->size, m->blocks, 1, TIME_SEC(m->mtime), m->mode, m->links };
+
+    if (opt_usage && !bitfield_get(iselect, m->ino))
+      memset(&du, 0, sizeof(du)); /* Only the selected inodes are accounted */
+
+    if (!array_add(&du_sizes, &du, sizeof(du)))
+      err(6, "realloc() for e2du");
+  }
+  inodes_used++;
+
+  if (index_out)
+    index_add_inode(m);
+  return match;
+}
+
+/* Extent walk (--resolve-blocks, e2sum). The blocks of an inode are handed to
+ * extent_func() : the extent root is in the inode, deeper extent blocks are
+ * deferred to the end of pass 1 (see extents_finish()) and read level by
+ * level, in physical order. Block mapped files are walked by libext2fs. */
+#define EXTENT_META   1 /* Extent tree, indirect or xattr block, no data */
+#define EXTENT_UNINIT 2 /* Allocated but unwritten, reads as zeros */
+
+struct extent_node_t {
+  blk64_t    block;
+  ext2_ino_t ino;
+};
+
+static void (*extent_func)(ext2_ino_t ino, __u64 lblk, blk64_t pblk, __u32 len, int flags);
+static struct array extent_nodes; /* Array of extent_node_t, to be read */
+
+int blk64_cmp(const void *a, const void *b) {
+  blk64_t ba = *(blk64_t *)a;
+  blk64_t bb = *(blk64_t *)b;
+
+  return ba < bb ? -1 : ba > bb;
+}
+
+/* Walks the entries of an extent tree node, deferring its children */
+void extents_node(ext2_ino_t ino, struct ext3_extent_header *eh, size_t bytes) {
+  int entries;
+  int n;
+
+  entries = le16toh(eh->eh_entries);
+  if (le16toh(eh->eh_magic) != EXT3_EXT_MAGIC ||
+      sizeof(*eh) + entries * sizeof(struct ext3_extent) > bytes) {
+    fprintf(stderr, "warning: inode #%d: corrupted extent tree\n", ino);
+    return;
+  }
+
+  for (n = 0; n < entries; n++) {
+    if (le16toh(eh->eh_depth) == 0) { /* Leaf */
+      struct ext3_extent *ex = (struct ext3_extent *)(eh + 1) + n;
+      __u32 len = le16toh(ex->ee_len);
+      int flags = 0;
+
+      if (len > EXT_INIT_MAX_LEN) {
+        len -= EXT_INIT_MAX_LEN;
+        flags = EXTENT_UNINIT;
+      }
+      extent_func(ino, le32toh(ex->ee_block), le32toh(ex->ee_start) | (blk64_t)le16toh(ex->ee_start_hi) << 32, len, flags);
+    } else {
+      struct ext3_extent_idx *ix = (struct ext3_extent_idx *)(eh + 1) + n;
+      struct extent_node_t node;
+
+      node.block = le32toh(ix->ei_leaf) | (blk64_t)le16toh(ix->ei_leaf_hi) << 32;
+      node.ino = ino;
+      extent_func(ino, 0, node.block, 1, EXTENT_META);
+      array_add(&extent_nodes, &node, sizeof(node));
+    }
+  }
+}
+
+int extents_iterate_cb(ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt, blk64_t ref_blk, int ref_offset, void *private) {
+  extent_func(*(ext2_ino_t *)private, blockcnt < 0 ? 0 : blockcnt, *blocknr, 1, blockcnt < 0 ? EXTENT_META : 0);
+  return 0;
+}
+
+/* Pass 1 : walks the blocks of an inode read from an inode table */
+void extents_inode(ext2_ino_t ino, struct ext2_inode_large *inode) {
+  blk64_t acl;
+  int ret;
+
+  acl = ext2fs_file_acl_block(fs, (struct ext2_inode *)inode);
+  if (acl)
+    extent_func(ino, 0, acl, 1, EXTENT_META);
+
+  if (!inode_has_blocks(inode))
+    return;
+  if (inode->i_flags & EXT4_EXTENTS_FL) {
+    extents_node(ino, (struct ext3_extent_header *)inode->i_block, sizeof(inode->i_block));
+    return;
+  }
+
+  /* Old style block maps are rare enough nowadays, let libext2fs do it */
+  ret = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY, NULL, extents_iterate_cb, &ino);
+  if (ret)
+    fprintf(stderr, "warning: inode #%d: ext2fs_block_iterate3: error %d\n", ino, ret);
+}
+
+int extent_node_cmp(const void *a, const void *b) {
+  return blk64_cmp(&((struct extent_node_t *)a)->block, &((struct extent_node_t *)b)->block);
+}
+
+/* End of pass 1 : reads the deferred extent blocks, one tree level at a
+ * time, in physical order */
+void extents_finish() {
+  char *buf;
+  size_t level;
+
+  buf = malloc(fs->blocksize);
+  if (!buf)
+    err(6, "malloc(%d bytes) for extent block", fs->blocksize);
+
+  for (level = 1; extent_nodes.count; level++) {
+    struct array nodes;
+    size_t n;
+    int ret;
+
+    nodes = extent_nodes;
+    array_init(&extent_nodes);
+    qsort(nodes.buffer, nodes.count, sizeof(struct extent_node_t), extent_node_cmp);
+    dbg("reading %zu extent blocks (level %zu)", nodes.count, level);
+    for (n = 0; n < nodes.count; n++) {
+      struct extent_node_t *node = (struct extent_node_t *)nodes.buffer + n;
+
+      ret = io_channel_read_blk64(fs->io, node->block, 1, buf);
+      if (ret) {
+        fprintf(stderr, "warning: inode #%d: reading extent block %llu: error %d\n", node->ino, (unsigned long long)node->block, ret);
+        continue;
+      }
+      extents_node(node->ino, (struct ext3_extent_header *)buf, fs->blocksize);
+    }
+    free(nodes.buffer);
+  }
+  free(buf);
+}
+
+
+/* Block to inode mapping (--resolve-blocks) : the blocks of every inode are
+ * checked against the sorted list of wanted blocks. */
+struct block_hit_t {
+  ext2_ino_t ino;
+  blk64_t    block;
+};
+
+static blk64_t *wblocks = NULL;       /* Wanted blocks, sorted */
+static size_t   wblocks_count = 0;
+static char    *wblocks_found = NULL; /* Bit-addressed by wblocks[] index */
+static struct array block_hits;       /* Array of block_hit_t, sorted by inode after pass 1 */
+
+/* Records the wanted blocks within [start, start+len) as owned by #ino */
+void blocks_check(ext2_ino_t ino, __u64 lblk, blk64_t start, __u32 len, int flags) {
+  size_t lo, hi;
+
+  for (lo = 0, hi = wblocks_count; lo < hi; ) {
+    size_t mid = (lo + hi) / 2;
+
+    if (wblocks[mid] < start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < wblocks_count && wblocks[lo] < start + len; lo++) {
+    struct block_hit_t hit;
+
+    dbg("block %llu: inode #%d", (unsigned long long)wblocks[lo], ino);
+    hit.ino = ino;
+    hit.block = wblocks[lo];
+    array_add(&block_hits, &hit, sizeof(hit));
+    bitfield_set(wblocks_found, lo);
+    bitfield_set(iselect, ino);
+  }
+}
+
+void resolve_blocks_read() {
+  struct array wanted;
+  char word[32];
+  unsigned long long block;
+  char *end;
+  size_t i, j;
+
+  array_init(&wanted);
+  while (scanf("%31s", word) == 1) {
+    block = strtoull(word, &end, 10);
+    if (*end || block >= ext2fs_blocks_count(fs->super)) {
+      fprintf(stderr, "warning: --resolve-blocks: ignoring '%s'\n", word);
+      continue;
+    }
+    if (!array_add(&wanted, &block, sizeof(blk64_t)))
+      err(6, "realloc() for wanted blocks");
+  }
+  wblocks = (blk64_t *)wanted.buffer;
+  qsort(wblocks, wanted.count, sizeof(blk64_t), blk64_cmp);
+  for (i = 0, j = 0; i < wanted.count; i++)
+    if (j == 0 || wblocks[j - 1] != wblocks[i])
+      wblocks[j++] = wblocks[i];
+  wblocks_count = j;
+  dbg("%zu blocks to resolve", wblocks_count);
+
+  bitfield_init(&wblocks_found, wblocks_count);
+  array_init(&block_hits);
+  array_init(&extent_nodes);
+  extent_func = blocks_check;
+}
+
+int block_hit_cmp(const void *a, const void *b) {
+  const struct block_hit_t *ha = a;
+  const struct block_hit_t *hb = b;
+
+  if (ha->ino != hb->ino)
+    return ha->ino < hb->ino ? -1 : 1;
+  return blk64_cmp(&ha->block, &hb->block);
+}
+
+void resolve_blocks_finish() {
+  size_t i;
+
+  extents_finish();
+  qsort(block_hits.buffer, block_hits.count, sizeof(struct block_hit_t), block_hit_cmp);
+  for (i = 0; i < wblocks_count; i++)
+    if (!bitfield_get(wblocks_found, i))
+      fprintf(stderr, "warning: block %llu is not used by any file\n", (unsigned long long)wblocks[i]);
+}
+
+/* First hit of #ino in block_hits[], NULL if none */
+struct block_hit_t * blocks_hits(ext2_ino_t ino) {
+  struct block_hit_t *hits = (struct block_hit_t *)block_hits.buffer;
+  size_t lo, hi;
+
+  for (lo = 0, hi = block_hits.count; lo < hi; ) {
+    size_t mid = (lo + hi) / 2;
+
+    if (hits[mid].ino < ino)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < block_hits.count && hits[lo].ino == ino ? &hits[lo] : NULL;
+}
+
+/* SHA-256 (FIPS 180-4), for e2sum */
+struct sha256_t {
+  __u32 h[8];
+  __u64 bytes;
+  unsigned char buf[64];
+};
+
+static const __u32 sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(struct sha256_t *c) {
+  static const __u32 h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memcpy(c->h, h0, sizeof(h0));
+  c->bytes = 0;
+}
+
+void sha256_block(struct sha256_t *c, const unsigned char *p) {
+  __u32 w[64];
+  __u32 a, b, d, e, f, g, h, cc;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = be32toh(((__u32 *)p)[i]);
+  for (; i < 64; i++)
+    w[i] = w[i - 16] + (ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+           w[i - 7] + (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+  a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+  e = c->h[4]; f = c->h[5]; g = c->h[6]; h = c->h[7];
+  for (i = 0; i < 64; i++) {
+    __u32 t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    __u32 t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+
+    h = g; g = f; f = e; e = d + t1;
+    d = cc; cc = b; b = a; a = t1 + t2;
+  }
+  c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+  c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+/* data may be NULL for zeros (holes) */
+void sha256_update(struct sha256_t *c, const unsigned char *data, size_t len) {
+  size_t used = c->bytes & 63;
+
+  c->bytes += len;
+  if (used) {
+    size_t n = 64 - used < len ? 64 - used : len;
+
+    if (data) {
+      memcpy(c->buf + used, data, n);
+      data += n;
+    } else
+      memset(c->buf + used, 0, n);
+    len -= n;
+    if (used + n < 64)
+      return;
+    sha256_block(c, c->buf);
+  }
+  if (!data)
+    memset(c->buf, 0, 64);
+  for (; len >= 64; len -= 64) {
+    if (data) {
+      sha256_block(c, data);
+      data += 64;
+    } else
+      sha256_block(c, c->buf);
+  }
+  if (len) {
+    if (data)
+      memcpy(c->buf, data, len);
+    else
+      memset(c->buf, 0, len);
+  }
+}
+
+void sha256_final(struct sha256_t *c, unsigned char *digest) {
+  unsigned char pad[72];
+  __u64 bits = htobe64(c->bytes * 8);
+  size_t padlen;
+  int i;
+
+  padlen = ((c->bytes & 63) < 56 ? 56 : 120) - (c->bytes & 63);
+  memset(pad, 0, padlen);
+  pad[0] = 0x80;
+  memcpy(pad + padlen, &bits, 8);
+  sha256_update(c, pad, padlen + 8);
+  for (i = 0; i < 8; i++)
+    ((__u32 *)digest)[i] = htobe32(c->h[i]);
+}
+
+
+/* Sweep (e2sum, --archive) : reads the data of the selected files in a single
+ * forward pass over the disk. The data extents of all files are gathered in
+ * pass 1, sorted by physical block and read with large reads. A file's data
+ * is consumed in logical order : extents read ahead of their turn are kept in
+ * memory until then. Files which would need more than SWEEP_REORDER_BYTES of
+ * such buffers are read again after the sweep, in logical order. Holes and
+ * unwritten extents read as zeros. See sweep_run(). */
+#define SWEEP_READ_BYTES    (8*1024*1024)
+#define SWEEP_REORDER_BYTES (256*1024*1024)
+
+#define SWEEP_BUFFERED 0x100 /* sweep_extent_t.data is a copy, to be freed */
+
+struct sweep_extent_t {
+  ext2_ino_t ino;
+  __u32      len;
+  __u64      lblk;
+  blk64_t    pblk;
+  int        flags;
+  char      *data;  /* Read, waiting for its turn */
+};
+
+struct sweep_file_t {
+  struct inode_meta_t meta;
+  size_t           first;    /* Its extents in sweep_extents[], in logical order */
+  size_t           count;
+  size_t           next;     /* Next extent to be consumed */
+  size_t           pending;  /* Data extents not read yet */
+  __u64            pos;      /* Bytes consumed */
+  int              begun;
+  int              stream;   /* --archive : its extents are read in a row */
+  int              deferred; /* To be read again after the sweep, -1 if skipped */
+  struct sha256_t  sha;      /* e2sum */
+  unsigned char    digest[32];
+  __u32            rdev;     /* --archive : devices */
+  char            *symlink;  /* --archive : symlink target */
+  char            *inline_data; /* Data stored in the inode (inline_data) */
+  size_t           inline_size;
+};
+
+static struct array sweep_extents; /* Array of sweep_extent_t */
+static struct array sweep_files;   /* Array of sweep_file_t, by inode number */
+static size_t sweep_buffered = 0;  /* Bytes of extents read ahead of their turn */
+
+/* extent_func() : data extents of selected files. Contiguous ones are merged
+ * (block maps come block by block), long ones are split to fit in a read. */
+void sweep_extent(ext2_ino_t ino, __u64 lblk, blk64_t pblk, __u32 len, int flags) {
+  struct sweep_extent_t *last;
+  struct sweep_extent_t e;
+  __u32 max;
+
+  if (flags & EXTENT_META)
+    return;
+  max = SWEEP_READ_BYTES / fs->blocksize;
+  last = sweep_extents.count ? (struct sweep_extent_t *)sweep_extents.buffer + sweep_extents.count - 1 : NULL;
+  if (last && last->ino == ino && last->flags == flags && last->lblk + last->len == lblk &&
+      last->pblk + last->len == pblk && last->len + len <= max) {
+    last->len += len;
+    return;
+  }
+  for (; len; lblk += e.len, pblk += e.len, len -= e.len) {
+    e.ino   = ino;
+    e.lblk  = lblk;
+    e.pblk  = pblk;
+    e.len   = len < max ? len : max;
+    e.flags = flags;
+    e.data  = NULL;
+    if (!array_add(&sweep_extents, &e, sizeof(e)))
+      err(6, "realloc() for extents");
+  }
+}
+
+/* Data stored in the inode itself, NULL (with a warning) if unreadable */
+char * sweep_inline(ext2_ino_t ino, struct ext2_inode_large *inode, size_t *size) {
+  char *data;
+  int ret;
+
+  data = malloc(fs->blocksize);
+  if (!data)
+    err(6, "malloc() for inline data");
+  ret = ext2fs_inline_data_get(fs, ino, (struct ext2_inode *)inode, data, size);
+  if (ret) {
+    fprintf(stderr, "warning: inode #%d: reading inline data: error %d\n", ino, ret);
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/* Symlink target, from the inode or from its block */
+char * sweep_symlink(ext2_ino_t ino, struct ext2_inode_large *inode) {
+  char *target;
+  size_t len;
+  int ret;
+
+  len = EXT2_I_SIZE(inode);
+  target = malloc(len + 1 > fs->blocksize ? len + 1 : fs->blocksize);
+  if (!target)
+    err(6, "malloc() for symlink");
+  if (inode->i_flags & EXT4_INLINE_DATA_FL) {
+    char *data;
+    size_t size;
+
+    data = sweep_inline(ino, inode, &size);
+    if (!data || size < len)
+      len = 0;
+    else
+      memcpy(target, data, len);
+    free(data);
+  } else if (ext2fs_is_fast_symlink((struct ext2_inode *)inode))
+    memcpy(target, inode->i_block, len);
+  else {
+    blk64_t pblk;
+
+    ret = ext2fs_bmap2(fs, ino, (struct ext2_inode *)inode, NULL, 0, 0, NULL, &pblk);
+    if (!ret)
+      ret = io_channel_read_blk64(fs->io, pblk, 1, target);
+    if (ret) {
+      fprintf(stderr, "warning: inode #%d: reading symlink: error %d\n", ino, ret);
+      len = 0;
+    }
+  }
+  target[len] = '\0';
+  return target;
+}
+
+/* Pass 1 : a selected inode. Its data extents are only needed for regular
+ * files, --archive also needs the other ones (folders, symlinks...) */
+void sweep_inode(ext2_ino_t ino, struct ext2_inode_large *inode, struct inode_meta_t *m) {
+  struct sweep_file_t f;
+
+  memset(&f, 0, sizeof(f));
+  f.meta = *m;
+  if (LINUX_S_ISLNK(m->mode))
+    f.symlink = sweep_symlink(ino, inode);
+  if (LINUX_S_ISCHR(m->mode) || LINUX_S_ISBLK(m->mode)) {
+    /* Old (8:8 bits) or new encoding, kept in the new one */
+    if (inode->i_block[0])
+      f.rdev = (inode->i_block[0] & 0xff) | ((inode->i_block[0] >> 8 & 0xff) << 8);
+    else
+      f.rdev = inode->i_block[1];
+  }
+  if (!LINUX_S_ISREG(m->mode))
+    f.meta.size = 0; /* No data in the sweep */
+  else if (inode->i_flags & EXT4_INLINE_DATA_FL) {
+    /* No extents, the data is consumed with the (empty) sweep of the file */
+    f.inline_data = sweep_inline(ino, inode, &f.inline_size);
+    if (!f.inline_data)
+      return; /* Skipped */
+    if (f.inline_size > f.meta.size)
+      f.inline_size = f.meta.size;
+  }
+  if (!array_add(&sweep_files, &f, sizeof(f)))
+    err(6, "realloc() for files");
+  if (LINUX_S_ISREG(m->mode) && !f.inline_data)
+    extents_inode(ino, inode);
+}
+
+/* e2sum with --name or subtrees : the files are picked from their surviving
+ * dirents after pass 2 (see sweep_select()), not swept as soon as their inode
+ * matches */
+int sweep_dirents() {
+  return opt_sum && (names_count || prefixes.count || excludes.count);
+}
+
+void sweep_init() {
+  array_init(&sweep_extents);
+  array_init(&sweep_files);
+  array_init(&extent_nodes);
+  extent_func = sweep_extent;
+}
+
+int sweep_extent_cmp(const void *a, const void *b) {
+  const struct sweep_extent_t *ea = a;
+  const struct sweep_extent_t *eb = b;
+
+  if (ea->ino != eb->ino)
+    return ea->ino < eb->ino ? -1 : 1;
+  return ea->lblk < eb->lblk ? -1 : ea->lblk > eb->lblk;
+}
+
+int sweep_file_cmp(const void *a, const void *b) {
+  ext2_ino_t ia = ((struct sweep_file_t *)a)->meta.ino;
+  ext2_ino_t ib = ((struct sweep_file_t *)b)->meta.ino;
+
+  return ia < ib ? -1 : ia > ib;
+}
+
+struct sweep_file_t * sweep_file(ext2_ino_t ino) {
+  struct sweep_file_t key;
+
+  key.meta.ino = ino;
+  return bsearch(&key, sweep_files.buffer, sweep_files.count, sizeof(key), sweep_file_cmp);
+}
+
+/* Inode scan callback, at the end of each group : stops at the end of the run
+ * before libext2fs reads the inode table of the next group */
+#define SCAN_RUN_DONE 1
+
+errcode_t scan_group_done(ext2_filsys fs, ext2_inode_scan scan, dgrp_t group, void *last) {
+  return group >= *(dgrp_t *)last ? SCAN_RUN_DONE : 0;
+}
+
+/* Read the inode tables of block groups [first, last]. Groups are scanned in
+ * runs of consecutive groups to keep reads sequential. */
+void scan_groups(dgrp_t first, dgrp_t last) {
+  ext2_ino_t last_ino;
+  int ret;
+
+  last_ino = (last + 1) * fs->super->s_inodes_per_group;
+  ext2fs_set_inode_callback(scan, scan_group_done, &last);
+  ret = ext2fs_inode_scan_goto_blockgroup(scan, first);
+  if (ret)
+    err(7, "ext2fs_inode_scan_goto_blockgroup(%d): error %d", first, ret);
+
+  while (1) {
+    ext2_ino_t ino;
+    struct ext2_inode_large inode;
+    struct inode_meta_t m;
+    int match;
+
+    ret = ext2fs_get_next_inode_full(scan, &ino, (struct ext2_inode *)&inode, sizeof(inode));
+    if (ret == SCAN_RUN_DONE)
+      break;
+    if (ret) {
+      fprintf(stderr, "warning: selecting inode #%d: scan error %d\n", ino, ret);
+      continue;
+    }
+
+    /* The scan goes on with the next groups, we stop at the end of the run */
+    if (ino == 0 || ino > last_ino)
+      break;
+    inodes_scanned++;
+
+    if ((ino < EXT2_GOOD_OLD_FIRST_INO && ino != EXT2_ROOT_INO) || /* Ignore special inodes - except the root one */
+        inode.i_links_count == 0)                                  /* Ignore unused inode */
+      continue;
+
+    inode_meta_fill(ino, &inode, &m);
+    match = inode_add(&m);
+    if (opt_resolve_blocks && match)
+      extents_inode(ino, &inode);
+    else if ((opt_sum || opt_archive) && !sweep_dirents() && bitfield_get(iselect, ino))
+      sweep_inode(ino, &inode, &m);
+  }
+}
+
+/* Reuse the inodes of a block group from the previous index. Records are
+ * sorted by inode number, we simply go on from where we stopped last time.
+ *
+ * With --journal, inodes whose inode table block has been logged are read
+ * again, the group is then walked inode by inode. */
+static size_t reuse_cursor = 0;
+
+void reuse_group(dgrp_t group) {
+  ext2_ino_t first_ino;
+  ext2_ino_t last_ino;
+  ext2_ino_t ino;
+
+  first_ino = group * fs->super->s_inodes_per_group + 1;
+  last_ino  = (group + 1) * fs->super->s_inodes_per_group;
+  if (!ijournal || !bitfield_get(gjournal, group)) {
+    for (; reuse_cursor < previous.header->inodes && previous.inodes[reuse_cursor].ino <= last_ino; reuse_cursor++)
+      if (previous.inodes[reuse_cursor].ino >= first_ino)
+        inode_add(&previous.inodes[reuse_cursor]);
+    return;
+  }
+
+  for (; reuse_cursor < previous.header->inodes && previous.inodes[reuse_cursor].ino < first_ino; reuse_cursor++)
+    ;
+  for (ino = first_ino; ino <= last_ino; ino++) {
+    struct ext2_inode_large inode;
+    struct inode_meta_t m;
+    struct inode_meta_t *cached;
+    int ret;
+
+    cached = NULL;
+    if (reuse_cursor < previous.header->inodes && previous.inodes[reuse_cursor].ino == ino)
+      cached = &previous.inodes[reuse_cursor++];
+
+    if (!bitfield_get(ijournal, ino)) {
+      if (cached)
+        inode_add(cached);
+      continue;
+    }
+
+    inodes_scanned++;
+    if (ino < EXT2_GOOD_OLD_FIRST_INO && ino != EXT2_ROOT_INO)
+      continue;
+    /* The newest logged copy, which may not be in the inode table yet */
+    ret = journal_inode(ino, &inode);
+    if (ret < 0) {
+      fprintf(stderr, "warning: reading inode #%d from the journal\n", ino);
+      continue;
+    }
+    if (!ret) {
+      memset(&inode, 0, sizeof(inode));
+      ret = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode, sizeof(inode));
+    } else
+      ret = 0;
+    if (ret) {
+      fprintf(stderr, "warning: reading inode #%d: error %d\n", ino, ret);
+      continue;
+    }
+    if (inode.i_links_count == 0)
+      continue;
+    inode_meta_fill(ino, &inode, &m);
+    inode_add(&m);
+  }
+}
+
+int group_changed(dgrp_t group) {
+  struct index_group_t g;
+
+  if (!previous.map)
+    return 1;
+  if (ijournal)
+    return 0; /* The journal tells which inodes changed */
+  group_state(group, &g);
+  return memcmp(&g, &previous.groups[group], sizeof(g)) != 0;
+}
+
+/* --sample : pass 1 on a random subset of the block groups which have used
+ * inodes. The used inode count of every group is known from its descriptor :
+ * the counts are extrapolated with a ratio estimator (per used inode), with
+ * 95% confidence intervals from the variance between sampled groups. */
+int dgrp_cmp(const void *a, const void *b) {
+  dgrp_t ga = *(dgrp_t *)a;
+  dgrp_t gb = *(dgrp_t *)b;
+
+  return ga < gb ? -1 : ga > gb;
+}
+
+void sample_groups() {
+  dgrp_t *groups;
+  dgrp_t population = 0;
+  dgrp_t count;
+  dgrp_t n;
+  double used = 0;
+  double before[COUNT_VALUES];
+  double sx = 0, sxx = 0;
+  double sy[COUNT_VALUES], syy[COUNT_VALUES], sxy[COUNT_VALUES];
+  int k;
+
+  groups = malloc(fs->group_desc_count * sizeof(dgrp_t));
+  if (!groups)
+    err(6, "malloc() for --sample");
+  for (n = 0; n < fs->group_desc_count; n++)
+    if (ext2fs_bg_free_inodes_count(fs, n) < fs->super->s_inodes_per_group) {
+      used += fs->super->s_inodes_per_group - ext2fs_bg_free_inodes_count(fs, n);
+      groups[population++] = n;
+    }
+  used -= EXT2_GOOD_OLD_FIRST_INO - 2; /* As count_groups() */
+
+  /* Partial Fisher-Yates shuffle, then the sample is read in disk order */
+  count = ceil(population * opt_sample / 100);
+  if (count < 2)
+    count = population < 2 ? population : 2;
+  count_margined = count >= 2; /* Otherwise all the (0 or 1) used groups are read */
+  srandom(time(NULL) ^ getpid());
+  for (n = 0; n < count; n++) {
+    dgrp_t r = n + random() % (population - n);
+    dgrp_t g = groups[r];
+
+    groups[r] = groups[n];
+    groups[n] = g;
+  }
+  qsort(groups, count, sizeof(dgrp_t), dgrp_cmp);
+  dbg("[1] Sampling %u groups out of %u used ones", count, population);
+
+  memset(sy, 0, sizeof(sy));
+  memset(syy, 0, sizeof(syy));
+  memset(sxy, 0, sizeof(sxy));
+  for (n = 0; n < count; n++) {
+    double after[COUNT_VALUES];
+    double x;
+
+    x = fs->super->s_inodes_per_group - ext2fs_bg_free_inodes_count(fs, groups[n]);
+    if (groups[n] == 0)
+      x -= EXT2_GOOD_OLD_FIRST_INO - 2;
+    count_vector(before);
+    scan_groups(groups[n], groups[n]);
+    count_vector(after);
+    sx  += x;
+    sxx += x * x;
+    for (k = 0; k < COUNT_VALUES; k++) {
+      double y = after[k] - before[k];
+
+      sy[k]  += y;
+      syy[k] += y * y;
+      sxy[k] += x * y;
+    }
+  }
+
+  /* Y = R.X with R = sum(y) / sum(x), and Var(Y) = N^2 (1 - n/N) / n
+   * times the variance of the residuals y - R.x */
+  for (k = 0; k < COUNT_VALUES && sx > 0; k++) {
+    double r = sy[k] / sx;
+    double var = count > 1 ? (syy[k] - 2 * r * sxy[k] + r * r * sxx) / (count - 1) : 0;
+
+    before[k] = r * used;
+    var = (double)population * population * (1 - (double)count / population) / count * (var > 0 ? var : 0);
+    count_margins[k] = 1.96 * sqrt(var);
+  }
+  if (sx > 0)
+    count_unvector(before);
+  free(groups);
+}
+
+
+/* Index diff (--diff) : both indexes are merge-joined, first on inode number
+ * to tell which inodes changed, then on dirent identity (parent folder inode
+ * and name) to tell which names changed. */
+
+int index_dir_cmp(const void *a, const void *b) {
+  ext2_ino_t ia = ((struct index_dir_t *)a)->ino;
+  ext2_ino_t ib = ((struct index_dir_t *)b)->ino;
+
+  return ia < ib ? -1 : ia > ib;
+}
+
+#define index_dirent_next(d) \
+  ((struct dirent_t *)((char *)(d) + sizeof(struct dirent_empty_t) + ((strlen((d)->name) + 4) & ~3)))
+#define index_dirents_end(idx) ((struct dirent_t *)((idx)->dirents + (idx)->header->dirents_bytes))
+
+/* Builds the folders bitfield and the folder to dirent map of an index */
+void index_dirs(struct index_t *idx) {
+  struct dirent_t *d;
+  size_t count;
+  __u64 i;
+
+  bitfield_init(&idx->isdir, idx->header->inodes_count + 1);
+  for (count = 0, i = 0; i < idx->header->inodes; i++)
+    if (LINUX_S_ISDIR(idx->inodes[i].mode)) {
+      bitfield_set(idx->isdir, idx->inodes[i].ino);
+      count++;
+    }
+
+  idx->dirs = malloc((count + 1) * sizeof(struct index_dir_t));
+  if (!idx->dirs)
+    err(6, "malloc(%zu folders) for index", count);
+  for (count = 0, d = (struct dirent_t *)idx->dirents; d < index_dirents_end(idx); d = index_dirent_next(d))
+    if (bitfield_get(idx->isdir, d->ino)) {
+      idx->dirs[count].ino = d->ino;
+      idx->dirs[count].offset = (char *)d - idx->dirents;
+      count++;
+    }
+  qsort(idx->dirs, count, sizeof(struct index_dir_t), index_dir_cmp);
+  idx->dirs_count = count;
+}
+
+struct dirent_t * index_dir(struct index_t *idx, ext2_ino_t ino) {
+  struct index_dir_t key;
+  struct index_dir_t *dir;
+
+  key.ino = ino;
+  dir = bsearch(&key, idx->dirs, idx->dirs_count, sizeof(key), index_dir_cmp);
+  return dir ? (struct dirent_t *)(idx->dirents + dir->offset) : NULL;
+}
+
+/* Same as dirent_to_path(), for a dirent of an index */
+int index_path(struct index_t *idx, struct dirent_t *d, char *path, int path_max) {
+  int pos;
+  int i = 0;
+
+  pos = path_max;
+  path[--pos] = '\0';
+
+  while (1) {
+    int len;
+    int isroot;
+
+    isroot = (*d->name == '\0');
+    if (i++ || isroot) {
+      if (pos < 1)
+        return 1; /* path[] overflow */
+      path[--pos] = '/';
+    }
+    if (i > 255) /* Too many components */
+      return 2;
+    if (isroot)
+      break;
+
+    len = strlen(d->name);
+    if (len > pos)
+      return 1; /* path[] overflow */
+    pos -= len;
+    memcpy(&path[pos], d->name, len);
+
+    d = index_dir(idx, d->parent);
+    if (!d)
+      return 3; /* Orphan */
+  }
+
+  memmove(path, &path[pos], path_max - pos);
+  return 0;
+}
+
+/* Per-inode diff state, bit-addressed by #ino */
+static char *dnew  = NULL; /* Not the same inode anymore (created or reused) */
+static char *ddata = NULL; /* Same inode, data changed (mtime or size) */
+static char *dmeta = NULL; /* Same inode, metadata changed (ctime) */
+static char *dgone_done  = NULL; /* Memoization for diff_gone() */
+static char *dgone       = NULL;
+static char *dmoved_done = NULL; /* Memoization for diff_moved() */
+static char *dmoved      = NULL;
+
+int diff_same_dir(struct index_t *new, ext2_ino_t ino) {
+  return bitfield_get(new->isdir, ino) && !bitfield_get(dnew, ino);
+}
+
+/* Did the folder's name or parent change ? */
+int diff_renamed(struct dirent_t *od, struct dirent_t *nd) {
+  return !od || !nd || od->parent != nd->parent || strcmp(od->name, nd->name) != 0;
+}
+
+/* Is the old path of this folder gone ? Then its old entries need not to be
+ * listed as deleted : deleting the topmost one is enough. */
+int diff_gone(struct index_t *old, struct index_t *new, ext2_ino_t ino) {
+  struct dirent_t *od;
+  int gone;
+
+  if (bitfield_get(dgone_done, ino))
+    return bitfield_get(dgone, ino);
+
+  if (!diff_same_dir(new, ino))
+    gone = 1;
+  else if (ino == EXT2_ROOT_INO)
+    gone = 0;
+  else {
+    od = index_dir(old, ino);
+    gone = diff_renamed(od, index_dir(new, ino)) || diff_gone(old, new, od->parent);
+  }
+
+  bitfield_set(dgone_done, ino);
+  if (gone)
+    bitfield_set(dgone, ino);
+  return gone;
+}
+
+/* Is the new path of this folder within a renamed folder ? Then its entries
+ * are listed by diff_moved_subtrees(), since they all have a new path. */
+int diff_moved(struct index_t *old, struct index_t *new, ext2_ino_t ino) {
+  struct dirent_t *nd;
+  int moved;
+
+  if (bitfield_get(dmoved_done, ino))
+    return bitfield_get(dmoved, ino);
+
+  nd = index_dir(new, ino);
+  if (ino == EXT2_ROOT_INO || !nd)
+    moved = 0;
+  else if (diff_same_dir(new, ino) && diff_renamed(index_dir(old, ino), nd))
+    moved = 1;
+  else
+    moved = diff_moved(old, new, nd->parent);
+
+  bitfield_set(dmoved_done, ino);
+  if (moved)
+    bitfield_set(dmoved, ino);
+  return moved;
+}
+
+void diff_show(struct index_t *idx, struct dirent_t *d, char change) {
+  char path[PATH_MAX];
+  int ret;
+
+  ret = index_path(idx, d, path, PATH_MAX);
+  if (ret) {
+    fprintf(stderr, "warning: #%d/'%s': path resolution error %d\n", d->ino, d->name, ret);
+    return;
+  }
+  if (opt_show_change)
+    printf("%c %s%c", change, path, newline);
+  else
+    printf("%s%c", path, newline);
+}
+
+int dirent_name_cmp(const void *a, const void *b) {
+  return strcmp((*(struct dirent_t **)a)->name, (*(struct dirent_t **)b)->name);
+}
+
+/* Collects the entries of folder #parent into a sorted array of pointers, *d
+ * is moved past them */
+void diff_dir_entries(struct index_t *idx, struct dirent_t **d, ext2_ino_t parent, struct array *entries) {
+  entries->count = entries->bytes_used = 0;
+  for (; *d < index_dirents_end(idx) && (*d)->parent == parent; *d = index_dirent_next(*d))
+    array_add(entries, d, sizeof(*d));
+  qsort(entries->buffer, entries->count, sizeof(*d), dirent_name_cmp);
+}
+
+void diff_dir(struct index_t *old, struct index_t *new, ext2_ino_t parent, struct array *oents, struct array *nents) {
+  struct dirent_t **o = (struct dirent_t **)oents->buffer;
+  struct dirent_t **n = (struct dirent_t **)nents->buffer;
+  struct dirent_t **oend = o + oents->count;
+  struct dirent_t **nend = n + nents->count;
+  int gone;
+  int moved;
+
+  gone  = diff_gone(old, new, parent);
+  moved = diff_moved(old, new, parent);
+  while (o < oend || n < nend) {
+    int cmp;
+
+    cmp = o == oend ? 1 : n == nend ? -1 : strcmp((*o)->name, (*n)->name);
+    if (cmp == 0 && (*o)->ino == (*n)->ino && !bitfield_get(dnew, (*n)->ino)) {
+      /* Same name, same inode */
+      if (!moved && bitfield_get(ddata, (*n)->ino))
+        diff_show(new, *n, 'U');
+      else if (!moved && bitfield_get(dmeta, (*n)->ino))
+        diff_show(new, *n, 'M');
+      o++;
+      n++;
+      continue;
+    }
+    if (cmp <= 0) {
+      if (!gone)
+        diff_show(old, *o, 'D');
+      o++;
+    }
+    if (cmp >= 0) {
+      if (!moved)
+        diff_show(new, *n, bitfield_get(dnew, (*n)->ino) ? 'N' : 'R');
+      n++;
+    }
+  }
+}
+
+/* Entries within renamed folders are skipped by diff_dir(), list them all */
+void diff_moved_subtrees(struct index_t *old, struct index_t *new) {
+  struct dirent_t *d;
+
+  for (d = (struct dirent_t *)new->dirents; d < index_dirents_end(new); d = index_dirent_next(d))
+    if (*d->name && diff_moved(old, new, d->parent))
+      diff_show(new, d, bitfield_get(dnew, d->ino) ? 'N' : 'R');
+}
+
+void index_diff(struct index_t *old, struct index_t *new) {
+  struct array oents;
+  struct array nents;
+  struct dirent_t *od;
+  struct dirent_t *nd;
+  size_t inodes_count;
+  __u64 i, j;
+
+  inodes_count = (old->header->inodes_count > new->header->inodes_count ?
+    old->header->inodes_count : new->header->inodes_count) + 1;
+  bitfield_init(&dnew, inodes_count);
+  bitfield_init(&ddata, inodes_count);
+  bitfield_init(&dmeta, inodes_count);
+  bitfield_init(&dgone_done, inodes_count);
+  bitfield_init(&dgone, inodes_count);
+  bitfield_init(&dmoved_done, inodes_count);
+  bitfield_init(&dmoved, inodes_count);
+  index_dirs(old);
+  index_dirs(new);
+
+  /* Inodes : both arrays are sorted by inode number */
+  dbg("[diff] Inodes");
+  for (i = 0, j = 0; j < new->header->inodes; ) {
+    struct inode_meta_t *o = i < old->header->inodes ? &old->inodes[i] : NULL;
+    struct inode_meta_t *n = &new->inodes[j];
+
+    if (o && o->ino < n->ino) {
+      i++; /* Deleted, seen by its names */
+      continue;
+    }
+    if (!o || o->ino > n->ino)
+      bitfield_set(dnew, n->ino);
+    else if (o->generation != n->generation || (o->mode & LINUX_S_IFMT) != (n->mode & LINUX_S_IFMT))
+      bitfield_set(dnew, n->ino);
+    else {
+      if (o->mtime != n->mtime || o->size != n->size)
+        bitfield_set(ddata, n->ino);
+      if (o->ctime != n->ctime)
+        bitfield_set(dmeta, n->ino);
+    }
+    if (o && o->ino == n->ino)
+      i++;
+    j++;
+  }
+
+  /* Dirents : both sections are grouped by parent folder in inode order */
+  dbg("[diff] Dirents");
+  array_init(&oents);
+  array_init(&nents);
+  od = (struct dirent_t *)old->dirents;
+  nd = (struct dirent_t *)new->dirents;
+  while (od < index_dirents_end(old) || nd < index_dirents_end(new)) {
+    ext2_ino_t parent;
+
+    if (od == index_dirents_end(old))
+      parent = nd->parent;
+    else if (nd == index_dirents_end(new))
+      parent = od->parent;
+    else
+      parent = od->parent < nd->parent ? od->parent : nd->parent;
+
+    diff_dir_entries(old, &od, parent, &oents);
+    diff_dir_entries(new, &nd, parent, &nents);
+    diff_dir(old, new, parent, &oents, &nents);
+  }
+  diff_moved_subtrees(old, new);
+}
+
+
+/* Subtree scan (--subtree) : rather than every inode table and every folder,
+ * only the subtree is read, top-down one level at a time. The blocks of a
+ * level's folders are read in physical block order, then the inodes of their
+ * entries in inode number order, that is in inode table order. The entries
+ * are kept with inode numbers (as in an index) until pass 2. */
+struct subtree_block_t {
+  blk64_t    pblk;
+  ext2_ino_t ino;
+};
+
+static struct array subtree_metas;   /* Array of inode_meta_t, as read */
+static struct array subtree_entries; /* Array of dirent_t, with inode numbers */
+static struct array subtree_blocks;  /* Array of subtree_block_t, of a level's folders */
+static struct array subtree_level;   /* Array of ext2_ino_t, the inodes of a level's entries */
+
+void subtree_entry(ext2_ino_t ino, const char *name, int name_len, ext2_ino_t parent) {
+  struct dirent_t d;
+  int padding;
+
+  d.ino = ino;
+  d.parent = parent;
+  memcpy(d.name, name, name_len);
+  padding = 4 - (name_len & 3);
+  memset(d.name + name_len, 0, padding);
+  if (!array_add(&subtree_entries, &d, sizeof(struct dirent_empty_t) + name_len + padding))
+    err(6, "realloc() for --subtree");
+}
+
+/* Reads an inode, folders are added to the next level */
+void subtree_inode(ext2_ino_t ino, struct array *folders) {
+  struct ext2_inode_large inode;
+  struct inode_meta_t m;
+  int ret;
+
+  ret = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode, sizeof(inode));
+  if (ret) {
+    fprintf(stderr, "warning: inode #%d: read error %d\n", ino, ret);
+    return;
+  }
+  inodes_scanned++;
+  inode_meta_fill(ino, &inode, &m);
+  if (!array_add(&subtree_metas, &m, sizeof(m)))
+    err(6, "realloc() for --subtree");
+  if (folders && LINUX_S_ISDIR(m.mode) && !array_add(folders, &ino, sizeof(ino)))
+    err(6, "realloc() for --subtree");
+}
+
+/* An entry of a level's folder, its inode is read with the level's others */
+void subtree_add(struct ext2_dir_entry *dirent, ext2_ino_t parent) {
+  int name_len = dirent->name_len & 0xff;
+
+  /* Skip unused entries, '.' and '..' */
+  if (!dirent->inode || dirent->inode == parent || (name_len == 2 && dirent->name[0] == '.' && dirent->name[1] == '.'))
+    return;
+  subtree_entry(dirent->inode, dirent->name, name_len, parent);
+  if (bitfield_get(isubtree, dirent->inode))
+    return; /* Hard link */
+  bitfield_set(isubtree, dirent->inode);
+  if (!array_add(&subtree_level, &dirent->inode, sizeof(dirent->inode)))
+    err(6, "realloc() for --subtree");
+}
+
+int subtree_block_cb(ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt, blk64_t ref_blk, int ref_offset, void *private) {
+  struct subtree_block_t b;
+
+  b.pblk = *blocknr;
+  b.ino = *(ext2_ino_t *)private;
+  if (!array_add(&subtree_blocks, &b, sizeof(b)))
+    err(6, "realloc() for --subtree");
+  return 0;
+}
+
+int subtree_dirent_cb(struct ext2_dir_entry *dirent, int offset, int blocksize, char *buf, void *private) {
+  subtree_add(dirent, *(ext2_ino_t *)private);
+  return 0;
+}
+
+int subtree_block_cmp(const void *a, const void *b) {
+  blk64_t ba = ((struct subtree_block_t *)a)->pblk;
+  blk64_t bb = ((struct subtree_block_t *)b)->pblk;
+
+  return ba < bb ? -1 : ba > bb;
+}
+
+int ino_cmp(const void *a, const void *b) {
+  ext2_ino_t ia = *(ext2_ino_t *)a;
+  ext2_ino_t ib = *(ext2_ino_t *)b;
+
+  return ia < ib ? -1 : ia > ib;
+}
+
+/* One level : the blocks of its folders, then the inodes of their entries.
+ * Returns the next level's folders in *folders. */
+void subtree_level_scan(struct array *folders) {
+  ext2_ino_t *ino = (ext2_ino_t *)folders->buffer;
+  struct subtree_block_t *b;
+  unsigned int rec_len;
+  unsigned int offset;
+  char *buf;
+  size_t n;
+  int ret;
+
+  subtree_blocks.count = subtree_blocks.bytes_used = 0;
+  for (n = 0; n < folders->count; n++) {
+    ret = ext2fs_block_iterate3(fs, ino[n], BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY, NULL, subtree_block_cb, &ino[n]);
+    if (ret) {
+      /* Inline data : the entries are in the inode itself */
+      ret = ext2fs_dir_iterate(fs, ino[n], 0, NULL, subtree_dirent_cb, &ino[n]);
+      if (ret)
+        err(8, "ext2fs_dir_iterate: error %d", ret);
+    }
+  }
+
+  dbg("--subtree: %zu folders, %zu blocks", folders->count, subtree_blocks.count);
+  qsort(subtree_blocks.buffer, subtree_blocks.count, sizeof(struct subtree_block_t), subtree_block_cmp);
+  buf = malloc(fs->blocksize);
+  if (!buf)
+    err(6, "malloc() for --subtree");
+  for (n = 0, b = (struct subtree_block_t *)subtree_blocks.buffer; n < subtree_blocks.count; n++, b++) {
+    ret = ext2fs_read_dir_block4(fs, b->pblk, buf, 0, b->ino);
+    if (ret) {
+      fprintf(stderr, "warning: folder #%d: reading block %llu: error %d\n", b->ino, (unsigned long long)b->pblk, ret);
+      continue;
+    }
+    for (offset = 0; offset + 8 <= fs->blocksize; offset += rec_len) {
+      struct ext2_dir_entry *dirent = (struct ext2_dir_entry *)(buf + offset);
+
+      if (ext2fs_get_rec_len(fs, dirent, &rec_len) || rec_len < 8 || offset + rec_len > fs->blocksize)
+        break;
+      subtree_add(dirent, b->ino);
+    }
+  }
+  free(buf);
+
+  folders->count = folders->bytes_used = 0;
+  ino = (ext2_ino_t *)subtree_level.buffer;
+  qsort(ino, subtree_level.count, sizeof(*ino), ino_cmp);
+  for (n = 0; n < subtree_level.count; n++)
+    subtree_inode(ino[n], folders);
+  subtree_level.count = subtree_level.bytes_used = 0;
+}
+
+/* Drops the '.' components of a --subtree path, and the ones cancelled by a
+ * '..' : each ancestor must be read and named only once */
+void subtree_normalize(const char *path, char *out, size_t size) {
+  size_t used = 0;
+  size_t len;
+
+  while (1) {
+    while (*path == '/')
+      path++;
+    len = strcspn(path, "/");
+    if (!len)
+      break;
+    if (len == 2 && path[0] == '.' && path[1] == '.') {
+      while (used && out[used - 1] != '/')
+        used--;
+      if (used)
+        used--;
+    } else if (len != 1 || path[0] != '.') {
+      if (used + 1 + len >= size)
+        err(3, "--subtree: path too long");
+      out[used++] = '/';
+      memcpy(out + used, path, len);
+      used += len;
+    }
+    path += len;
+  }
+  out[used] = '\0';
+}
+
+/* Pass 1 for --subtree. Ancestors are read too, as their names are needed for
+ * the paths, but they are not selected (see inode_match()). */
+void subtree_scan(const char *subtree) {
+  struct inode_meta_t *m;
+  struct array folders;
+  ext2_ino_t ino = EXT2_ROOT_INO;
+  char path_buf[PATH_MAX];
+  char *path = path_buf;
+  size_t len;
+  size_t n;
+  int ret;
+
+  subtree_normalize(subtree, path_buf, sizeof(path_buf));
+
+  bitfield_init(&isubtree, fs->super->s_inodes_count + 1);
+  array_init(&subtree_metas);
+  array_init(&subtree_entries);
+  array_init(&subtree_blocks);
+  array_init(&subtree_level);
+  array_init(&folders);
+
+  subtree_entry(EXT2_ROOT_INO, "", 0, EXT2_ROOT_INO);
+  while (1) {
+    ext2_ino_t child;
+
+    while (*path == '/')
+      path++;
+    len = strcspn(path, "/");
+    if (!len)
+      break;
+    subtree_inode(ino, NULL);
+    ret = ext2fs_lookup(fs, ino, path, len, NULL, &child);
+    if (ret)
+      err(3, "--subtree: '%.*s' not found: error %d", (int)len, path, ret);
+    subtree_entry(child, path, len, ino);
+    ino = child;
+    path += len;
+  }
+  bitfield_set(isubtree, ino);
+  subtree_inode(ino, &folders);
+  if (!folders.count)
+    err(3, "--subtree: not a folder");
+
+  while (folders.count)
+    subtree_level_scan(&folders);
+  free(folders.buffer);
+  free(subtree_blocks.buffer);
+  free(subtree_level.buffer);
+
+  /* inodes[] is sorted by inode number */
+  qsort(subtree_metas.buffer, subtree_metas.count, sizeof(struct inode_meta_t), inode_meta_cmp);
+  for (n = 0, m = (struct inode_meta_t *)subtree_metas.buffer; n < subtree_metas.count; n++, m++)
+    inode_add(m);
+  free(subtree_metas.buffer);
+}
+
+/* Pass 2 for --subtree : the entries have already been read */
+void subtree_dirents() {
+  struct dirent_t *d;
+  struct dirent_t *end = (struct dirent_t *)(subtree_entries.buffer + subtree_entries.bytes_used);
+  ext2_ino_t parent = 0;
+  unsigned int parent_idx = 0;
+
+  for (d = (struct dirent_t *)subtree_entries.buffer; d < end; d = index_dirent_next(d)) {
+    if (d->parent != parent) {
+      if (!inode_lookup(d->parent, &parent_idx))
+        continue;
+      parent = d->parent;
+    }
+    dirent_add(d->ino, d->name, strlen(d->name), d->parent, parent_idx);
+  }
+  free(subtree_entries.buffer);
+}
+
+/* Releases what scan_fs() allocated, before scanning again */
+void scan_free() {
+  free(iisdir);
+  free(iselect);
+  free(idirkeep);
+  free(ijournal);
+  free(gjournal);
+  free(itables);
+  free(journal.buf);
+  free(inodes.buffer);
+  free(dirents.buffer);
+  free(first_blocks.buffer);
+  free(du_sizes.buffer);
+  free(idu);
+  free(top);
+  top = NULL;
+  top_count = 0;
+  iisdir = iselect = idirkeep = ijournal = gjournal = idu = NULL;
+  itables = NULL;
+  journal.buf = NULL;
+  if (previous.map)
+    munmap(previous.map, previous.size);
+  memset(&previous, 0, sizeof(previous));
+  reuse_cursor = reuse_offset = 0;
+  inodes_scanned = inodes_used = inodes_selected = 0;
+}
+
+/* Passes 1 to 2.5 : fills in inodes[] and dirents[], with dirents[].parent
+ * referencing the parent folder's dirent. May be called again by --serve
+ * after scan_free(). */
+void scan_fs() {
+  int ret;
+  char *anyp;
+  unsigned int index;
+  dgrp_t group;
+  dgrp_t last;
+
+  dbg("opening fs '%s'", fspath);
+  ret = ext2fs_open(fspath, 0, 0, 0, unix_io_manager, &fs);
+  if (ret)
+    err(5, "ext2fs_open(%s): error %d", fspath, ret);
+  dbg("fs open: %d inodes, %d used (%.1f%%)",
+    fs->super->s_inodes_count,
+    fs->super->s_inodes_count - fs->super->s_free_inodes_count,
+    (fs->super->s_inodes_count - fs->super->s_free_inodes_count) * 100. / fs->super->s_inodes_count);
+
+  bitfield_init(&iisdir, fs->super->s_inodes_count);
+  bitfield_init(&iselect, fs->super->s_inodes_count);
+  if (opt_resolve_inodes && !iwanted)
+    resolve_inodes_read(); /* Only once, stdin is kept across --serve refreshes */
+  if (opt_resolve_blocks)
+    resolve_blocks_read();
+  if (opt_sum || opt_archive)
+    sweep_init();
+  array_init(&inodes);  /* Dynamically grows, no initial size */
+  if (scan_dirents())
+    array_init(&dirents); /* Dynamically grows, no initial size */
+  else
+    memset(&dirents, 0, sizeof(dirents));
+  if (opt_block_order)
+    array_init(&first_blocks);
+  if (opt_usage) {
+    array_init(&usage_uids);
+    array_init(&usage_gids);
+    memset(usage_ages, 0, sizeof(usage_ages));
+    usage_now = time(NULL);
+  }
+  if (opt_du || opt_ncdu || opt_usage == USAGE_DIRS) {
+    array_init(&du_sizes);
+    bitfield_init(&idu, fs->super->s_inodes_count + 1);
+  }
+  if (top_max) {
+    top = malloc(top_max * sizeof(struct top_t));
+    if (!top)
+      err(6, "malloc() for --top");
+  }
   dbg("array[%p]: inodes initialized", &inodes);
   dbg("array[%p]: dirents initialized", &dirents);
 
-  if (opt_show_mtime && opt_show_ctime) {
-    inodes_eltype = INODES_MTIME_CTIME;
-    inodes_elsize = sizeof(struct inode_t);
+  if (opt_incremental) {
+    if (index_load(opt_incremental, &previous))
+      bitfield_init(&idirkeep, fs->super->s_inodes_count);
+    else
+      fprintf(stderr, "warning: ignoring --incremental, running a full scan\n");
+  }
+  if (opt_journal && !previous.map)
+    err(1, "--journal requires a usable --incremental index");
+  if (opt_diff) {
+    /* We diff from an index of the current scan, which may be temporary */
+    if (!index_load(opt_diff, &diffbase))
+      err(13, "--diff: unusable index");
+    if (!opt_save_index) {
+      int fd;
+
+      diff_tmp = strdup("/tmp/e2find.XXXXXX");
+      fd = mkstemp(diff_tmp);
+      if (fd < 0)
+        err(12, "mkstemp(%s): %s", diff_tmp, strerror(errno));
+      close(fd);
+      opt_save_index = diff_tmp;
+    }
+  }
+  if (opt_save_index)
+    index_create(opt_save_index);
+  if (opt_journal)
+    journal_mark(opt_journal_since ? opt_journal_since : previous.header->journal_seq);
+  else if (opt_save_index)
+    index_out_header.journal_seq = journal_head(&index_out_header.journal_block);
+
+  /* Pass 1 : inode scan, see inode_add() for what's filled in.
+   *
+   * Inode tables are read group by group. With a previous index, groups whose
+   * descriptor did not change are not read again : their inodes are reused
+   * from the index.
+   */
+  ret = ext2fs_open_inode_scan(fs, buffer_blocks, &scan);
+  if (ret)
+    err(7, "ext2fs_open_inode_scan: error %d", ret);
+
+  dbg("[1] Inode scan");
+  if (opt_subtree)
+    subtree_scan(opt_subtree);
+  else if (opt_sample)
+    sample_groups();
+  else {
+    for (group = 0; group < fs->group_desc_count; group = last + 1) {
+      if (!group_changed(group)) {
+        dbg("group %d: unchanged, reusing index", group);
+        reuse_group(group);
+        last = group;
+        continue;
+      }
+      for (last = group; last + 1 < fs->group_desc_count && group_changed(last + 1); last++)
+        ;
+      dbg("groups %d-%d: scanning", group, last);
+      scan_groups(group, last);
+    }
+  }
+  dbg("inode scan done, %d scanned (%.1f%%)", inodes_scanned, inodes_scanned * 100. / fs->super->s_inodes_count);
+  dbg("%d inode selected out of %d used inodes (%.1f%%)", inodes_selected, inodes_used, inodes_selected * 100. / inodes_used);
+  if (iwanted)
+    resolve_inodes_check();
+  if (opt_resolve_blocks)
+    resolve_blocks_finish();
+  if ((opt_sum || opt_archive) && !sweep_dirents())
+    extents_finish();
+  if (opt_top && !opt_du)
+    top_select();
+
+  ext2fs_close_inode_scan(scan);
+
+  if (!scan_dirents()) {
+    dbg("[2] Dirent scan not needed");
+    ext2fs_close(fs);
+    fs = NULL;
+    return;
+  }
+
+  /* Pass 2 : dirent scan.
+   *
+   * In order to run ino->fullpath inverse resolutions, we need to collect all
+   * dirents with parenting information. This loop run ext2fs_dir_iterate() on
+   * every folder inode. The dirent_cb() callback fills dirents[] in.
+   *
+   * With a previous index, the entries of folders which did not change are
+   * reused from the index and their blocks are not read.
+   */
+  dbg("[2] Dirent scan");
+  if (opt_subtree)
+    subtree_dirents();
+  else {
+    for (index = 0, anyp = inodes.buffer; index < inodes.count; anyp += inodes_elsize, index++) {
+      /* The block_buf parameter should either be NULL, or if the
+       * ext2fs_dir_iterate function is called repeatedly, the overhead of
+       * allocating and freeing scratch memory can be avoided by passing a
+       * pointer to a scratch buffer which must be at least as big as the
+       * filesystem’s blocksize. */
+      char dirbuf[64*1024];
+      struct inode_t *ip;
+      ext2_ino_t ino;
+      struct dirent_cb_t cb;
+
+      ip = (struct inode_t *)anyp;
+      ino = ip->ino;
+
+      if (!bitfield_get(iisdir, ip->ino)) /* Filter non-dir inodes */
+        continue;
+
+      if (previous.map && bitfield_get(idirkeep, ino)) {
+        dbg("#%-8d i%d (folder, unchanged)", ino, index);
+        reuse_dirents(ino, index);
+        continue;
+      }
+
+      dbg("#%-8d i%d (folder)", ino, index);
+      cb.parent_ino = ino;
+      cb.parent_ino_idx = index;
+      ret = ext2fs_dir_iterate(fs, ino, 0, dirbuf, dirent_cb, &cb);
+      if (ret)
+        err(8, "ext2fs_dir_iterate: error %d", ret);
+    }
+  }
+  dbg("dirent scan done (%zu dirents)", dirents.count);
+
+  if (opt_save_index)
+    index_finish(opt_save_index);
+
+  if (!opt_sum && !opt_archive) { /* Still needed for the sweep */
+    ext2fs_close(fs);
+    fs = NULL;
+  }
+
+  /* Pass 2.5 : fix dirents[] .parent-as-inodes[]-index into .parent-as-dirents[]-index
+   */
+  dbg("[2.5] Converting dirents[].parent");
+  for (index = 0, anyp = dirents.buffer; index < dirents.count; index++) {
+    struct dirent_t *d;
+    struct inode_t *ip;
+    size_t name_len;
+
+    d = (struct dirent_t *)anyp;
+    ip = (struct inode_t *)(inodes.buffer + inodes_elsize * d->parent);
+    dbg("d%-8ld %-24s : i%-8d -> d%-8d", anyp - dirents.buffer, d->name, d->parent,  ip->dirent);
+    d->parent = ip->dirent;
+
+    name_len = strlen(d->name);
+    anyp += sizeof(struct dirent_empty_t) + ((name_len + 4) & ~3);
+  }
+}
+
+
+/* Lookup tables over dirents[] (after pass 2.5), for --serve. Both group
+ * dirent offsets by inode (inodes[] index) with a counting sort : the group of
+ * inode #i is [at[i], at[i+1]). */
+struct tree_t {
+  unsigned int *names;       /* Dirents of an inode (its names) */
+  unsigned int *names_at;
+  unsigned int *children;    /* Dirents of a folder (its entries), sorted by name */
+  unsigned int *children_at;
+};
+
+static struct tree_t tree;
+
+unsigned int tree_key_ino(struct dirent_t *d) {
+  return d->ino;
+}
+
+unsigned int tree_key_parent(struct dirent_t *d) {
+  return ((struct dirent_t *)(dirents.buffer + d->parent))->ino;
+}
+
+void tree_group(unsigned int (*key)(struct dirent_t *), int children, unsigned int **offsets, unsigned int **at) {
+  struct dirent_t *d;
+  struct dirent_t *end;
+  unsigned int *pos;
+  size_t i;
+
+  *offsets = malloc((dirents.count + 1) * sizeof(unsigned int));
+  *at = calloc(inodes.count + 1, sizeof(unsigned int));
+  pos = calloc(inodes.count + 1, sizeof(unsigned int));
+  if (!*offsets || !*at || !pos)
+    err(6, "malloc() for lookup tables");
+
+  end = (struct dirent_t *)(dirents.buffer + dirents.bytes_used);
+  for (d = (struct dirent_t *)dirents.buffer; d < end; d = index_dirent_next(d))
+    if (!children || *d->name) /* The root folder is nobody's entry */
+      (*at)[key(d) + 1]++;
+  for (i = 0; i < inodes.count; i++)
+    pos[i + 1] = (*at)[i + 1] += (*at)[i];
+  for (d = (struct dirent_t *)dirents.buffer; d < end; d = index_dirent_next(d))
+    if (!children || *d->name)
+      (*offsets)[pos[key(d)]++] = (char *)d - dirents.buffer;
+  free(pos);
+}
+
+int tree_name_cmp(const void *a, const void *b) {
+  return strcmp(((struct dirent_t *)(dirents.buffer + *(unsigned int *)a))->name,
+                ((struct dirent_t *)(dirents.buffer + *(unsigned int *)b))->name);
+}
+
+void tree_build() {
+  size_t i;
+
+  dbg("Building lookup tables");
+  tree_group(tree_key_ino, 0, &tree.names, &tree.names_at);
+  tree_group(tree_key_parent, 1, &tree.children, &tree.children_at);
+  for (i = 0; i < inodes.count; i++)
+    qsort(tree.children + tree.children_at[i], tree.children_at[i + 1] - tree.children_at[i],
+      sizeof(unsigned int), tree_name_cmp);
+}
+
+void tree_free() {
+  free(tree.names);
+  free(tree.names_at);
+  free(tree.children);
+  free(tree.children_at);
+  memset(&tree, 0, sizeof(tree));
+}
+
+#define tree_inode(idx) ((struct inode_t *)(inodes.buffer + inodes_elsize * (idx)))
+
+/* Resolves an absolute path, component by component, with a bisection of the
+ * sorted entries of each folder. Returns NULL if not found. */
+struct dirent_t * tree_lookup(const char *path) {
+  struct dirent_t *d;
+  unsigned int idx;
+  char name[256];
+
+  if (*path != '/' || !inode_lookup(EXT2_ROOT_INO, &idx) || !tree.names_at[idx + 1])
+    return NULL;
+  d = (struct dirent_t *)(dirents.buffer + tree.names[tree.names_at[idx]]);
+
+  while (*path) {
+    unsigned int lo, hi;
+    size_t len;
+
+    while (*path == '/')
+      path++;
+    len = strcspn(path, "/");
+    if (!len)
+      break;
+    if (len >= sizeof(name))
+      return NULL;
+    memcpy(name, path, len);
+    name[len] = '\0';
+    path += len;
+
+    for (lo = tree.children_at[idx], hi = tree.children_at[idx + 1]; lo < hi; ) {
+      unsigned int mid = (lo + hi) / 2;
+      int cmp;
+
+      d = (struct dirent_t *)(dirents.buffer + tree.children[mid]);
+      cmp = strcmp(d->name, name);
+      if (cmp == 0)
+        break;
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo >= hi)
+      return NULL;
+    idx = d->ino;
+  }
+  return d;
+}
+
+void serve_path(FILE *out, struct dirent_t *d) {
+  char path[PATH_MAX];
+  int ret;
+
+  ret = dirent_to_path(d, path, PATH_MAX);
+  if (ret)
+    fprintf(stderr, "warning: #%d/'%s': path resolution error %d\n", d->ino, d->name, ret);
+  else
+    fprintf(out, "%s\n", path);
+}
+
+/* Lists a subtree depth-first, in name order */
+void serve_ls(FILE *out, struct dirent_t *top) {
+  struct array stack;
+  unsigned int offset;
+
+  array_init(&stack);
+  offset = (char *)top - dirents.buffer;
+  array_add(&stack, &offset, sizeof(offset));
+  while (stack.count) {
+    struct dirent_t *d;
+    unsigned int i;
+
+    stack.count--;
+    stack.bytes_used -= sizeof(offset);
+    d = (struct dirent_t *)(dirents.buffer + *(unsigned int *)(stack.buffer + stack.bytes_used));
+    serve_path(out, d);
+    if (!bitfield_get(iisdir, tree_inode(d->ino)->ino))
+      continue;
+    for (i = tree.children_at[d->ino + 1]; i > tree.children_at[d->ino]; i--)
+      array_add(&stack, &tree.children[i - 1], sizeof(offset));
+  }
+  free(stack.buffer);
+}
+
+/* Runs one query line, the response is terminated by an empty line. Returns 0
+ * if the client asked to quit. */
+int serve_query(char *line, FILE *out) {
+  struct dirent_t *d;
+  struct inode_t *i;
+  char *arg;
+  unsigned int idx;
+  unsigned int n;
+
+  arg = strchr(line, ' ');
+  if (arg)
+    *arg++ = '\0';
+  else
+    arg = "";
+  dbg("[serve] '%s' '%s'", line, arg);
+
+  if (strcmp(line, "ino") == 0) {
+    if (sscanf(arg, "%u", &n) != 1 || !(i = inode_lookup(n, &idx)))
+      fprintf(out, "error: inode #%s not found\n", arg);
+    else
+      for (n = tree.names_at[idx]; n < tree.names_at[idx + 1]; n++)
+        serve_path(out, (struct dirent_t *)(dirents.buffer + tree.names[n]));
+  } else if (strcmp(line, "path") == 0) {
+    d = tree_lookup(arg);
+    if (!d)
+      fprintf(out, "error: %s: not found\n", arg);
+    else
+      fprintf(out, "%u\n", tree_inode(d->ino)->ino);
+  } else if (strcmp(line, "ls") == 0) {
+    d = tree_lookup(arg);
+    if (!d)
+      fprintf(out, "error: %s: not found\n", arg);
+    else
+      serve_ls(out, d);
+  } else if (strcmp(line, "after") == 0) {
+    if (sscanf(arg, "%u", &n) != 1)
+      fprintf(out, "error: after: positive integer expected\n");
+    else {
+      struct dirent_t *end = (struct dirent_t *)(dirents.buffer + dirents.bytes_used);
+
+      for (d = (struct dirent_t *)dirents.buffer; d < end; d = index_dirent_next(d)) {
+        i = tree_inode(d->ino);
+        if ((long long)inode_field(i, FIELD_MTIME) >= n || (long long)inode_field(i, FIELD_CTIME) >= n)
+          serve_path(out, d);
+      }
+    }
+  } else if (strcmp(line, "refresh") == 0) {
+    tree_free();
+    scan_free();
+    scan_fs();
+    tree_build();
+    fprintf(out, "ok %zu inodes %zu dirents\n", inodes.count, dirents.count);
+  } else if (strcmp(line, "quit") == 0)
+    return 0;
+  else
+    fprintf(out, "error: unknown query '%s'\n", line);
+
+  fputc('\n', out);
+  return 1;
+}
+
+void serve_client(int fd) {
+  char line[PATH_MAX + 16];
+  FILE *in;
+  FILE *out;
+
+  in = fdopen(fd, "r");
+  out = fdopen(dup(fd), "w");
+  if (!in || !out)
+    err(15, "fdopen(): %s", strerror(errno));
+
+  while (fgets(line, sizeof(line), in)) {
+    size_t len = strcspn(line, "\n");
+
+    if (!line[len] && !feof(in)) {
+      int c;
+
+      /* Longer than line[], the rest of it is skipped */
+      while ((c = getc(in)) != EOF && c != '\n')
+        ;
+      fprintf(out, "error: query too long\n\n");
+      if (fflush(out) != 0)
+        break;
+      continue;
+    }
+    line[len] = '\0';
+    if (!serve_query(line, out))
+      break;
+    if (fflush(out) != 0)
+      break; /* Client went away */
+  }
+  fclose(out);
+  fclose(in);
+}
+
+/* Answers queries on a Unix socket, one client at a time, forever */
+void serve(const char *path) {
+  struct sockaddr_un addr;
+  struct stat stat;
+  int sock;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    err(15, "--serve: socket path too long");
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* A socket left behind by a previous server */
+  if (lstat(path, &stat) == 0 && S_ISSOCK(stat.st_mode))
+    unlink(path);
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    err(15, "socket(): %s", strerror(errno));
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    err(15, "bind(%s): %s", path, strerror(errno));
+  if (listen(sock, 16) != 0)
+    err(15, "listen(%s): %s", path, strerror(errno));
+  signal(SIGPIPE, SIG_IGN);
+  dbg("[serve] Listening on '%s'", path);
+
+  while (1) {
+    int fd;
+
+    fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      err(15, "accept(%s): %s", path, strerror(errno));
+    }
+    serve_client(fd);
+  }
+}
+
+
+/* --archive : ustar stream on stdout, with GNU extensions for long names and
+ * large numbers, as GNU tar writes them */
+struct tar_header_t {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+static const char tar_zeros[512];
+
+void tar_write(const void *data, size_t len) {
+  if (len && fwrite(data, len, 1, stdout) != 1)
+    err(17, "writing archive: %s", strerror(errno));
+}
+
+void tar_pad(__u64 size) {
+  if (size % 512)
+    tar_write(tar_zeros, 512 - size % 512);
+}
+
+/* Octal, or GNU base-256 if it does not fit */
+void tar_number(char *field, size_t len, __u64 v) {
+  size_t i;
+
+  if (v < 1ULL << (3 * (len - 1))) {
+    snprintf(field, len, "%0*llo", (int)len - 1, (unsigned long long)v);
+    return;
+  }
+  memset(field, 0, len);
+  for (i = len - 1; i > 0; i--, v >>= 8)
+    field[i] = v & 0xff;
+  field[0] = 0x80;
+}
+
+void tar_checksum(struct tar_header_t *h) {
+  unsigned int sum = 0;
+  size_t i;
+
+  memset(h->chksum, ' ', sizeof(h->chksum));
+  for (i = 0; i < sizeof(*h); i++)
+    sum += ((unsigned char *)h)[i];
+  snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+}
+
+/* GNU ././@LongLink entry, for a name which does not fit in a header */
+void tar_longlink(char type, const char *name) {
+  struct tar_header_t h;
+  size_t len = strlen(name) + 1;
+
+  memset(&h, 0, sizeof(h));
+  strcpy(h.name, "././@LongLink");
+  tar_number(h.mode, sizeof(h.mode), 0644);
+  tar_number(h.uid, sizeof(h.uid), 0);
+  tar_number(h.gid, sizeof(h.gid), 0);
+  tar_number(h.size, sizeof(h.size), len);
+  tar_number(h.mtime, sizeof(h.mtime), 0);
+  h.typeflag = type;
+  memcpy(h.magic, "ustar ", 6);
+  memcpy(h.version, " ", 2);
+  tar_checksum(&h);
+  tar_write(&h, sizeof(h));
+  tar_write(name, len);
+  tar_pad(len);
+}
+
+void tar_entry(const char *path, char type, struct inode_meta_t *m, __u32 rdev, const char *link) {
+  struct tar_header_t h;
+  size_t len;
+  size_t p;
+
+  memset(&h, 0, sizeof(h));
+  len = strlen(path);
+  if (len <= sizeof(h.name))
+    memcpy(h.name, path, len);
+  else {
+    /* Split as prefix/name, or fall back to a long name entry */
+    for (p = len - sizeof(h.name) - 1; p < len && path[p] != '/'; p++)
+      ;
+    if (p < len && p <= sizeof(h.prefix)) {
+      memcpy(h.prefix, path, p);
+      memcpy(h.name, path + p + 1, len - p - 1);
+    } else {
+      tar_longlink('L', path);
+      memcpy(h.name, path, sizeof(h.name));
+    }
+  }
+  if (link) {
+    len = strlen(link);
+    if (len > sizeof(h.linkname))
+      tar_longlink('K', link);
+    memcpy(h.linkname, link, len < sizeof(h.linkname) ? len : sizeof(h.linkname));
+  }
+
+  tar_number(h.mode, sizeof(h.mode), m->mode & 07777);
+  tar_number(h.uid, sizeof(h.uid), m->uid);
+  tar_number(h.gid, sizeof(h.gid), m->gid);
+  tar_number(h.size, sizeof(h.size), type == '0' ? m->size : 0);
+  tar_number(h.mtime, sizeof(h.mtime), TIME_SEC(m->mtime) > 0 ? TIME_SEC(m->mtime) : 0);
+  h.typeflag = type;
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+  if (type == '3' || type == '4') {
+    /* rdev is in the new encoding (12:20 bits, interleaved) */
+    unsigned int major = (rdev & 0xfff00) >> 8;
+    unsigned int minor = (rdev & 0xff) | ((rdev >> 12) & 0xfff00);
+
+    tar_number(h.devmajor, sizeof(h.devmajor), major);
+    tar_number(h.devminor, sizeof(h.devminor), minor);
+  }
+  tar_checksum(&h);
+  tar_write(&h, sizeof(h));
+}
+
+char tar_type(__u16 mode) {
+  if (LINUX_S_ISREG(mode))  return '0';
+  if (LINUX_S_ISLNK(mode))  return '2';
+  if (LINUX_S_ISCHR(mode))  return '3';
+  if (LINUX_S_ISBLK(mode))  return '4';
+  if (LINUX_S_ISDIR(mode))  return '5';
+  if (LINUX_S_ISFIFO(mode)) return '6';
+  return 0; /* Sockets cannot be archived */
+}
+
+/* Archive path of the n-th name of an inode : relative, folders with a
+ * trailing / ; returns 0 for the root folder or on error */
+int tar_path(unsigned int n, char *path, int path_max) {
+  struct dirent_t *d = (struct dirent_t *)(dirents.buffer + tree.names[n]);
+  size_t len;
+
+  if (!*d->name || dirent_to_path(d, path, path_max) != 0)
+    return 0;
+  len = strlen(path);
+  memmove(path, path + 1, len);
+  if (bitfield_get(iisdir, tree_inode(d->ino)->ino) && len < path_max - 1)
+    strcat(path, "/");
+  return 1;
+}
+
+/* --archive : path of the first name of a file, 0 if it cannot be archived */
+int sweep_path(struct sweep_file_t *f, char *path) {
+  unsigned int idx;
+
+  if (!tar_type(f->meta.mode) || !inode_lookup(f->meta.ino, &idx) || tree.names_at[idx] == tree.names_at[idx + 1])
+    return 0;
+  return tar_path(tree.names_at[idx], path, PATH_MAX);
+}
+
+/* Sweep consumers : the start of a file, its data (NULL for zeros) in
+ * logical order, and its end */
+void sweep_begin(struct sweep_file_t *f) {
+  char path[PATH_MAX];
+
+  f->pos = 0;
+  if (opt_sum) {
+    sha256_init(&f->sha);
+    return;
+  }
+
+  /* --archive : the first name gets the data, the other ones are hard links */
+  sweep_path(f, path);
+  tar_entry(path, tar_type(f->meta.mode), &f->meta, f->rdev, f->symlink);
+}
+
+void sweep_data(struct sweep_file_t *f, unsigned char *data, size_t len) {
+  f->pos += len;
+  if (opt_sum)
+    sha256_update(&f->sha, data, len);
+  else {
+    if (data)
+      tar_write(data, len);
+    else
+      for (; len; len -= len < 512 ? len : 512)
+        tar_write(tar_zeros, len < 512 ? len : 512);
+  }
+}
+
+void sweep_end(struct sweep_file_t *f) {
+  char first[PATH_MAX];
+  char path[PATH_MAX];
+  unsigned int idx;
+  unsigned int n;
+
+  if (opt_sum) {
+    sha256_final(&f->sha, f->digest);
+    return;
+  }
+  tar_pad(f->pos);
+  sweep_path(f, first);
+  inode_lookup(f->meta.ino, &idx);
+  for (n = tree.names_at[idx] + 1; n < tree.names_at[idx + 1] && !opt_unique; n++)
+    if (tar_path(n, path, PATH_MAX))
+      tar_entry(path, '1', &f->meta, 0, first);
+}
+
+/* Consumes whatever is next in the file, until an extent not read yet. With
+ * --archive, files which are not streamed wait until they are complete. */
+void sweep_advance(struct sweep_file_t *f) {
+  struct sweep_extent_t *extents = (struct sweep_extent_t *)sweep_extents.buffer;
+
+  if (f->deferred < 0 || (!f->stream && f->pending))
+    return;
+  if (f->next == 0 && !f->begun) {
+    sweep_begin(f);
+    f->begun = 1;
+  }
+
+  while (f->next < f->count) {
+    struct sweep_extent_t *e = &extents[f->first + f->next];
+    __u64 start = e->lblk * fs->blocksize;
+    __u64 end = start + (__u64)e->len * fs->blocksize;
+
+    if (!e->data && !(e->flags & EXTENT_UNINIT))
+      return;
+    if (start > f->meta.size)
+      start = f->meta.size;
+    if (end > f->meta.size)
+      end = f->meta.size;
+    if (start > f->pos) /* Hole */
+      sweep_data(f, NULL, start - f->pos);
+    if (end > start)
+      sweep_data(f, e->flags & EXTENT_UNINIT ? NULL : (unsigned char *)e->data, end - start);
+    if (e->flags & SWEEP_BUFFERED) {
+      free(e->data);
+      e->flags &= ~SWEEP_BUFFERED;
+      sweep_buffered -= (size_t)e->len * fs->blocksize;
+    }
+    e->data = NULL;
+    f->next++;
+  }
+
+  if (f->inline_data) {
+    sweep_data(f, (unsigned char *)f->inline_data, f->inline_size);
+    free(f->inline_data);
+    f->inline_data = NULL;
+  }
+  if (f->pos < f->meta.size) /* Trailing hole */
+    sweep_data(f, NULL, f->meta.size - f->pos);
+  sweep_end(f);
+}
+
+/* Drops the extents read ahead of their turn, the file will be read again */
+void sweep_defer(struct sweep_file_t *f) {
+  struct sweep_extent_t *extents = (struct sweep_extent_t *)sweep_extents.buffer;
+  size_t n;
+
+  dbg("inode #%d: deferred", f->meta.ino);
+  for (n = f->next; n < f->count; n++) {
+    struct sweep_extent_t *e = &extents[f->first + n];
+
+    if (e->flags & SWEEP_BUFFERED) {
+      free(e->data);
+      e->data = NULL;
+      e->flags &= ~SWEEP_BUFFERED;
+      sweep_buffered -= (size_t)e->len * fs->blocksize;
+    }
+  }
+  f->deferred = 1;
+}
+
+/* Reads a deferred file in logical order */
+void sweep_direct(struct sweep_file_t *f, char *buf) {
+  struct sweep_extent_t *extents = (struct sweep_extent_t *)sweep_extents.buffer;
+  int ret;
+
+  f->next = 0;
+  f->pending = 0;
+  f->begun = 0;
+  while (f->next < f->count) {
+    struct sweep_extent_t *e = &extents[f->first + f->next];
+
+    if (!(e->flags & EXTENT_UNINIT)) {
+      ret = io_channel_read_blk64(fs->io, e->pblk, e->len, buf);
+      if (ret)
+        err(16, "inode #%d: reading %u blocks at %llu: error %d", f->meta.ino, e->len, (unsigned long long)e->pblk, ret);
+      e->data = buf;
+    }
+    sweep_advance(f); /* Only consumes this extent, the next ones have no data */
+  }
+}
+
+/* Sweep order */
+static struct sweep_extent_t *sweep_order_extents;
+
+int sweep_order_cmp(const void *a, const void *b) {
+  blk64_t ba = sweep_order_extents[*(size_t *)a].pblk;
+  blk64_t bb = sweep_order_extents[*(size_t *)b].pblk;
+
+  return ba < bb ? -1 : ba > bb;
+}
+
+/* After pass 2.5 : the sweep. Files with no data are done first. */
+void sweep_run() {
+  struct sweep_extent_t *extents;
+  struct sweep_file_t *files;
+  size_t *order;
+  size_t *rank;
+  size_t count;
+  size_t n, e;
+  char path[PATH_MAX];
+  char *buf;
+  blk64_t window = 0;
+  __u32 window_len = 0;
+  __u32 read_blocks;
+  int ret;
+
+  extents = (struct sweep_extent_t *)sweep_extents.buffer;
+  files = (struct sweep_file_t *)sweep_files.buffer;
+  qsort(extents, sweep_extents.count, sizeof(struct sweep_extent_t), sweep_extent_cmp);
+
+  /* Data extents, in physical order */
+  order = malloc(sweep_extents.count * sizeof(size_t));
+  rank = malloc(sweep_extents.count * sizeof(size_t));
+  read_blocks = SWEEP_READ_BYTES / fs->blocksize;
+  buf = malloc((size_t)read_blocks * fs->blocksize);
+  if (!order || !rank || !buf)
+    err(6, "malloc() for the sweep");
+  for (n = 0, count = 0; n < sweep_extents.count; n++)
+    if (!(extents[n].flags & EXTENT_UNINIT))
+      order[count++] = n;
+  sweep_order_extents = extents;
+  qsort(order, count, sizeof(size_t), sweep_order_cmp);
+  for (n = 0; n < count; n++)
+    rank[order[n]] = n;
+
+  /* Files and extents are both sorted by inode. With --archive, a file is
+   * streamed if its data extents come in a row and in logical order, since no
+   * other file may be written meanwhile. */
+  for (n = 0, e = 0; n < sweep_files.count; n++) {
+    struct sweep_file_t *f = &files[n];
+    size_t last = 0;
+
+    while (e < sweep_extents.count && extents[e].ino < f->meta.ino)
+      e++;
+    f->first = e;
+    f->stream = 1;
+    if (opt_archive && !sweep_path(f, path))
+      f->deferred = -1; /* Skipped, not even read */
+    for (; e < sweep_extents.count && extents[e].ino == f->meta.ino; e++) {
+      if (extents[e].flags & EXTENT_UNINIT)
+        continue;
+      if (opt_archive && f->pending && rank[e] != last + 1)
+        f->stream = 0;
+      last = rank[e];
+      f->pending++;
+    }
+    f->count = e - f->first;
+  }
+  free(rank);
+
+  /* --archive : streamed files must not begin before their data comes */
+  for (n = 0; n < sweep_files.count; n++)
+    if (opt_sum || !files[n].pending)
+      sweep_advance(&files[n]);
+
+  dbg("[sweep] Reading %zu extents of %zu files", count, sweep_files.count);
+  for (n = 0; n < count; n++) {
+    struct sweep_extent_t *x = &extents[order[n]];
+    struct sweep_file_t *f;
+    size_t bytes;
+    char *data;
+
+    f = sweep_file(x->ino);
+    if (f->deferred)
+      continue;
+
+    if (x->pblk < window || x->pblk + x->len > window + window_len) {
+      window = x->pblk;
+      window_len = read_blocks;
+      if (window + window_len > ext2fs_blocks_count(fs->super))
+        window_len = ext2fs_blocks_count(fs->super) - window;
+      ret = io_channel_read_blk64(fs->io, window, window_len, buf);
+      if (ret)
+        err(16, "reading %u blocks at %llu: error %d", window_len, (unsigned long long)window, ret);
+    }
+    data = buf + (x->pblk - window) * fs->blocksize;
+    bytes = (size_t)x->len * fs->blocksize;
+    f->pending--;
+
+    if (f->stream ? opt_archive || x == &extents[f->first + f->next] : !f->pending) {
+      x->data = data;
+      sweep_advance(f);
+      continue;
+    }
+
+    /* Ahead of its turn */
+    if (sweep_buffered + bytes > SWEEP_REORDER_BYTES) {
+      sweep_defer(f);
+      continue;
+    }
+    x->data = malloc(bytes);
+    if (!x->data)
+      err(6, "malloc(%zu bytes) for the sweep", bytes);
+    memcpy(x->data, data, bytes);
+    x->flags |= SWEEP_BUFFERED;
+    sweep_buffered += bytes;
+  }
+
+  for (n = 0; n < sweep_files.count; n++)
+    if (files[n].deferred == 1)
+      sweep_direct(&files[n], buf);
+  free(buf);
+  free(order);
+}
+
+/* Output format (--format) : compiled once into a list of emitters, each one
+ * specialised for a directive. Only the inode fields used by the format are
+ * stored in inodes[], see format_layout(). --show-mtime and --show-ctime are
+ * preset formats. */
+struct format_op_t {
+  void      (*emit)(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path);
+  int         width; /* As printf's, negative to left-justify */
+  int         field; /* In inode_fields[] */
+  const char *text;  /* format_text() */
+  size_t      len;
+};
+
+static struct array format; /* Array of format_op_t */
+static int format_path = 0; /* The full path is needed */
+
+void format_text(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  fwrite(o->text, 1, o->len, stdout);
+}
+
+void format_number(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  printf("%*llu", o->width, (unsigned long long)inode_field(i, o->field));
+}
+
+void format_seconds(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  printf("%*lld", o->width, (long long)inode_field(i, o->field));
+}
+
+void format_ino(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  printf("%*u", o->width, i->ino);
+}
+
+/* As find's %T@ : with 10 fractional digits */
+void format_time(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  __u64 t = inode_field(i, o->field);
+  char s[32];
+
+  snprintf(s, sizeof(s), "%lld.%09u0", TIME_SEC(t), TIME_NS(t));
+  printf("%*s", o->width, s);
+}
+
+void format_perm(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  printf("%*llo", o->width, (unsigned long long)inode_field(i, FIELD_MODE) & 07777);
+}
+
+char format_type_char(__u16 mode) {
+  switch (mode & LINUX_S_IFMT) {
+    case LINUX_S_IFDIR:  return 'd';
+    case LINUX_S_IFLNK:  return 'l';
+    case LINUX_S_IFCHR:  return 'c';
+    case LINUX_S_IFBLK:  return 'b';
+    case LINUX_S_IFIFO:  return 'p';
+    case LINUX_S_IFSOCK: return 's';
+    default:             return 'f';
+  }
+}
+
+void format_type(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  printf("%*c", o->width, format_type_char(inode_field(i, FIELD_MODE)));
+}
+
+/* As ls -l */
+void format_symbolic(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  __u16 mode = inode_field(i, FIELD_MODE);
+  char s[11];
+  int n;
+
+  s[0] = format_type_char(mode) == 'f' ? '-' : format_type_char(mode);
+  for (n = 0; n < 9; n++)
+    s[n + 1] = mode & (0400 >> n) ? "rwxrwxrwx"[n] : '-';
+  if (mode & LINUX_S_ISUID)
+    s[3] = s[3] == 'x' ? 's' : 'S';
+  if (mode & LINUX_S_ISGID)
+    s[6] = s[6] == 'x' ? 's' : 'S';
+  if (mode & LINUX_S_ISVTX)
+    s[9] = s[9] == 'x' ? 't' : 'T';
+  s[10] = '\0';
+  printf("%*s", o->width, s);
+}
+
+void format_fullpath(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  printf("%*s", o->width, path);
+}
+
+void format_basename(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  printf("%*s", o->width, *d->name ? d->name : "/");
+}
+
+void format_dirname(struct format_op_t *o, struct inode_t *i, struct dirent_t *d, const char *path) {
+  int len = strrchr(path, '/') - path;
+
+  printf("%*.*s", o->width, len ? len : 1, path);
+}
+
+void format_emit(void (*emit)(struct format_op_t *, struct inode_t *, struct dirent_t *, const char *), int width, int field, const char *text, size_t len) {
+  struct format_op_t o;
+
+  o.emit  = emit;
+  o.width = width;
+  o.field = field;
+  o.text  = text;
+  o.len   = len;
+  if (field >= 0)
+    inode_fields_needed[field] = 1;
+  if (emit == format_fullpath || emit == format_dirname)
+    format_path = 1;
+  if (!array_add(&format, &o, sizeof(o)))
+    err(6, "realloc() for --format");
+}
+
+/* Compiles a format, appended to the current one */
+void format_compile(const char *fmt) {
+  char *text;
+  char *t;
+
+  if (!format.buffer)
+    array_init(&format);
+  text = t = malloc(strlen(fmt) + 1); /* Literal text, escapes resolved */
+  if (!text)
+    err(6, "malloc() for --format");
+
+  while (*fmt) {
+    const char *start = t;
+    int width = 0;
+    int left = 0;
+    int field = -1;
+
+    /* Literal text, up to the next directive */
+    for (; *fmt && *fmt != '%'; fmt++) {
+      if (*fmt != '\\' || !fmt[1]) {
+        *t++ = *fmt;
+        continue;
+      }
+      switch (*++fmt) {
+        case 'n':  *t++ = '\n'; break;
+        case 't':  *t++ = '\t'; break;
+        case '0':  *t++ = '\0'; break;
+        case '\\': *t++ = '\\'; break;
+        default:
+          *t++ = '\\';
+          *t++ = *fmt;
+      }
+    }
+    if (t > start)
+      format_emit(format_text, 0, -1, start, t - start);
+    if (!*fmt)
+      break;
+
+    fmt++; /* % */
+    if (*fmt == '-') {
+      left = 1;
+      fmt++;
+    }
+    while (*fmt >= '0' && *fmt <= '9')
+      width = width * 10 + *fmt++ - '0';
+    if (left)
+      width = -width;
+
+    switch (*fmt) {
+      case '%':
+        format_emit(format_text, 0, -1, "%", 1);
+        break;
+      case 'i':
+        format_emit(format_ino, width, -1, NULL, 0);
+        break;
+      case 's':
+        format_emit(format_number, width, FIELD_SIZE, NULL, 0);
+        break;
+      case 'b':
+        format_emit(format_number, width, FIELD_BLOCKS, NULL, 0);
+        break;
+      case 'U':
+        format_emit(format_number, width, FIELD_UID, NULL, 0);
+        break;
+      case 'G':
+        format_emit(format_number, width, FIELD_GID, NULL, 0);
+        break;
+      case 'n':
+        format_emit(format_number, width, FIELD_LINKS, NULL, 0);
+        break;
+      case 'm':
+        format_emit(format_perm, width, FIELD_MODE, NULL, 0);
+        break;
+      case 'M':
+        format_emit(format_symbolic, width, FIELD_MODE, NULL, 0);
+        break;
+      case 'y':
+        format_emit(format_type, width, FIELD_MODE, NULL, 0);
+        break;
+      case 'p':
+        format_emit(format_fullpath, width, -1, NULL, 0);
+        break;
+      case 'f':
+        format_emit(format_basename, width, -1, NULL, 0);
+        break;
+      case 'h':
+        format_emit(format_dirname, width, -1, NULL, 0);
+        break;
+      case 'T':
+      case 'C':
+      case 'A':
+      case 'B':
+        field = *fmt == 'T' ? FIELD_MTIME : *fmt == 'C' ? FIELD_CTIME : *fmt == 'A' ? FIELD_ATIME : FIELD_CRTIME;
+        if (fmt[1] == '@')
+          format_emit(format_time, width, field - FIELD_MTIME + FIELD_MTIME_NS, NULL, 0);
+        else if (fmt[1] == 's')
+          format_emit(format_seconds, width, field, NULL, 0);
+        else
+          err(11, "--format: only %%%c@ and %%%cs are supported", *fmt, *fmt);
+        fmt++;
+        break;
+      default:
+        err(11, "--format: unknown directive '%%%c'", *fmt ? *fmt : ' ');
+    }
+    fmt++;
+  }
+  dbg("--format: %zu emitters", format.count);
+}
+
+/* --binary : records for programs, which do not need to parse text. The
+ * format only selects the fields, the full path is always written. After a
+ * header (BINARY_MAGIC, a version byte, a field count byte, then each field's
+ * directive on 2 bytes, eg. "s\0" or "T@"), each record is :
+ *
+ *   __u16 shared  bytes of the previous record's path which start this one
+ *   __u16 len     bytes of the path which follow the fields
+ *   __u64 fields  [count]
+ *   char  path    [len]
+ *
+ * Integers are little-endian. %m, %M and %y are the raw mode, %T@ (and
+ * others) are signed nanoseconds since the epoch. */
+#define BINARY_MAGIC   "e2findb"
+#define BINARY_VERSION 1
+
+static const char binary_directives[FIELDS][3] = {
+  "s", "b", "U", "G", "Ts", "Cs", "As", "Bs", "m", "n", "T@", "C@", "A@", "B@"
+};
+static char   binary_path[PATH_MAX]; /* Of the previous record */
+static size_t binary_path_len = 0;
+
+int binary_is_field(struct format_op_t *o) {
+  return o->emit == format_ino || o->field >= 0;
+}
+
+void binary_header() {
+  struct format_op_t *o = (struct format_op_t *)format.buffer;
+  struct format_op_t *end = o + format.count;
+  char header[sizeof(BINARY_MAGIC) + 2];
+  int count = 0;
+
+  memcpy(header, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+  header[sizeof(BINARY_MAGIC)] = BINARY_VERSION;
+  for (; o < end; o++)
+    count += binary_is_field(o);
+  if (count > 255)
+    err(11, "--binary: too many fields");
+  header[sizeof(BINARY_MAGIC) + 1] = count;
+  fwrite(header, 1, sizeof(header), stdout);
+  for (o = (struct format_op_t *)format.buffer; o < end; o++)
+    if (binary_is_field(o))
+      fwrite(o->emit == format_ino ? "i" : binary_directives[o->field], 1, 2, stdout);
+}
+
+void binary_show(struct inode_t *i, const char *path) {
+  struct format_op_t *o = (struct format_op_t *)format.buffer;
+  struct format_op_t *end = o + format.count;
+  __u16 head[2];
+  __u64 v;
+  size_t len = strlen(path);
+  size_t shared = 0;
+
+  while (shared < binary_path_len && shared < len && path[shared] == binary_path[shared])
+    shared++;
+  head[0] = htole16(shared);
+  head[1] = htole16(len - shared);
+  fwrite(head, 1, sizeof(head), stdout);
+  for (; o < end; o++) {
+    if (!binary_is_field(o))
+      continue;
+    v = o->emit == format_ino ? i->ino : inode_field(i, o->field);
+    if (o->emit == format_time)
+      v = TIME_SEC(v) * 1000000000LL + TIME_NS(v);
+    v = htole64(v);
+    fwrite(&v, 1, sizeof(v), stdout);
+  }
+  fwrite(path + shared, 1, len - shared, stdout);
+  memcpy(binary_path + shared, path + shared, len - shared);
+  binary_path_len = len;
+}
+
+void format_show(struct inode_t *i, struct dirent_t *d, const char *path) {
+  struct format_op_t *o = (struct format_op_t *)format.buffer;
+  struct format_op_t *end = o + format.count;
+
+  if (opt_binary) {
+    binary_show(i, path);
+    return;
+  }
+  for (; o < end; o++)
+    o->emit(o, i, d, path);
+}
+
+/* Subtrees (--include-subtree, --exclude-subtree) : resolved to dirents once
+ * after pass 2.5, folders are marked as within the output or pruned. Others
+ * take the state of their nearest marked ancestor : this is memoized per
+ * folder, so that pass 3 skips whole subtrees without building their paths,
+ * nor matching any string. */
+#define PREFIX_SCAN_MAX 8 /* Up to this many paths, scan dirents[] rather than building lookup tables */
+
+struct prefix_file_t {
+  unsigned int offset; /* Dirent of a path which is not a folder */
+  int          within;
+};
+
+static struct array prefix_files; /* Array of prefix_file_t, sorted by offset */
+static char *pdone   = NULL;      /* Bit-addressed by inodes[] index, folder state known */
+static char *pwithin = NULL;      /* Same, folder within the output */
+
+#define dirent_parent(d) ((struct dirent_t *)(dirents.buffer + (d)->parent))
+
+/* Resolves an absolute path with a scan of dirents[] per component, no lookup
+ * tables needed. Returns NULL if not found. */
+struct dirent_t * prefix_lookup(const char *path) {
+  struct dirent_t *found;
+  struct dirent_t *d;
+  struct dirent_t *end;
+  unsigned int idx;
+  unsigned int parent;
+  size_t len;
+
+  if (!inode_lookup(EXT2_ROOT_INO, &idx))
+    return NULL;
+  found = (struct dirent_t *)(dirents.buffer + tree_inode(idx)->dirent);
+  end = (struct dirent_t *)(dirents.buffer + dirents.bytes_used);
+  while (*path) {
+    while (*path == '/')
+      path++;
+    len = strcspn(path, "/");
+    if (!len)
+      break;
+    parent = (char *)found - dirents.buffer;
+    for (d = (struct dirent_t *)dirents.buffer; d < end; d = index_dirent_next(d))
+      if (d->parent == parent && strncmp(d->name, path, len) == 0 && d->name[len] == '\0')
+        break;
+    if (d >= end)
+      return NULL;
+    found = d;
+    path += len;
+  }
+  return found;
+}
+
+int prefix_file_cmp(const void *a, const void *b) {
+  unsigned int oa = ((struct prefix_file_t *)a)->offset;
+  unsigned int ob = ((struct prefix_file_t *)b)->offset;
+
+  return oa < ob ? -1 : oa > ob;
+}
+
+void prefix_mark(struct array *paths, int within, int tables) {
+  size_t n;
+
+  for (n = 0; n < paths->count; n++) {
+    const char *path = ((char **)paths->buffer)[n];
+    struct dirent_t *d = tables ? tree_lookup(path) : prefix_lookup(path);
+    struct prefix_file_t f;
+
+    if (!d) {
+      fprintf(stderr, "warning: subtree '%s': no such path\n", path);
+      continue;
+    }
+    dbg("subtree '%s': i%d d%ld %s", path, d->ino, (char *)d - dirents.buffer, within ? "included" : "excluded");
+    if (bitfield_get(iisdir, tree_inode(d->ino)->ino)) {
+      bitfield_set(pdone, d->ino);
+      if (within)
+        bitfield_set(pwithin, d->ino);
+      else
+        bitfield_clear(pwithin, d->ino);
+      continue;
+    }
+    f.offset = (char *)d - dirents.buffer;
+    f.within = within;
+    if (!array_add(&prefix_files, &f, sizeof(f)))
+      err(6, "realloc() for subtrees");
+  }
+}
+
+/* Excludes are marked last, they win over includes of the same path */
+void prefix_resolve() {
+  int tables;
+
+  array_init(&prefix_files);
+  bitfield_init(&pdone, inodes.count);
+  bitfield_init(&pwithin, inodes.count);
+  tables = prefixes.count + excludes.count > PREFIX_SCAN_MAX;
+  if (tables)
+    tree_build();
+  prefix_mark(&prefixes, 1, tables);
+  prefix_mark(&excludes, 0, tables);
+  if (tables)
+    tree_free();
+  qsort(prefix_files.buffer, prefix_files.count, sizeof(struct prefix_file_t), prefix_file_cmp);
+}
+
+int prefix_within(struct dirent_t *d) {
+  struct prefix_file_t *f;
+  struct prefix_file_t key;
+  struct dirent_t *folder;
+  struct dirent_t *up;
+  int within;
+
+  key.offset = (char *)d - dirents.buffer;
+  f = bsearch(&key, prefix_files.buffer, prefix_files.count, sizeof(key), prefix_file_cmp);
+  if (f)
+    return f->within;
+
+  /* Walk up to the first known folder, or to the root : without includes,
+   * everything is within the output */
+  folder = bitfield_get(iisdir, tree_inode(d->ino)->ino) ? d : dirent_parent(d);
+  for (up = folder; !bitfield_get(pdone, up->ino) && dirent_parent(up) != up; up = dirent_parent(up))
+    ;
+  within = bitfield_get(pdone, up->ino) ? bitfield_get(pwithin, up->ino) : !prefixes.count;
+  for (; ; folder = dirent_parent(folder)) {
+    bitfield_set(pdone, folder->ino);
+    if (within)
+      bitfield_set(pwithin, folder->ino);
+    if (folder == up)
+      break;
+  }
+  return within;
+}
+
+/* After pass 2, for sweep_dirents() : only the files which will be printed
+ * are swept, their inodes are read again */
+void sweep_select() {
+  struct array inos;
+  unsigned int index;
+  char *anyp;
+  size_t n;
+
+  array_init(&inos);
+  for (index = 0, anyp = dirents.buffer; index < dirents.count; index++, anyp = (char *)index_dirent_next((struct dirent_t *)anyp)) {
+    struct dirent_t *d = (struct dirent_t *)anyp;
+    ext2_ino_t ino = ((struct inode_t *)(inodes.buffer + inodes_elsize * d->ino))->ino;
+
+    if (!bitfield_get(iselect, ino) || bitfield_get(iisdir, ino))
+      continue;
+    if (names_count && !names_match(d->name, strlen(d->name)))
+      continue;
+    if ((prefixes.count || excludes.count) && !prefix_within(d))
+      continue;
+    if (!array_add(&inos, &ino, sizeof(ino)))
+      err(6, "realloc() for e2sum");
+  }
+  qsort(inos.buffer, inos.count, sizeof(ext2_ino_t), ino_cmp);
+  dbg("sweeping %zu files out of %zu dirents", inos.count, dirents.count);
+
+  for (n = 0; n < inos.count; n++) {
+    ext2_ino_t ino = ((ext2_ino_t *)inos.buffer)[n];
+    struct ext2_inode_large inode;
+    struct inode_meta_t m;
+    int ret;
+
+    if (n && ino == ((ext2_ino_t *)inos.buffer)[n - 1])
+      continue; /* Hard links */
+    ret = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode, sizeof(inode));
+    if (ret) {
+      fprintf(stderr, "warning: inode #%d: read error %d\n", ino, ret);
+      continue;
+    }
+    inode_meta_fill(ino, &inode, &m);
+    sweep_inode(ino, &inode, &m);
+  }
+  free(inos.buffer);
+  extents_finish();
+}
+
+/* Pass 3 : prints a dirent if its inode is selected */
+void dirent_show(struct dirent_t *d) {
+  struct inode_t *i;
+  char path[PATH_MAX];
+  int ret;
+
+  i = (struct inode_t *)(inodes.buffer + inodes_elsize * d->ino);
+  if (!bitfield_get(iselect, i->ino))
+    return; /* Not selected for output */
+  /* Folders are kept as ancestors whatever their name, and so are files
+   * when saving an index */
+  if (names_count && (opt_save_index || bitfield_get(iisdir, i->ino)) && !names_match(d->name, strlen(d->name)))
+    return;
+  if ((prefixes.count || excludes.count) && !prefix_within(d))
+    return;
+  if (opt_unique)
+    bitfield_clear(iselect, i->ino); /* Don't print another name for this inode */
+
+  *path = '\0';
+  if (format_path || opt_sum) {
+    ret = dirent_to_path(d, path, PATH_MAX);
+    if (ret) {
+      fprintf(stderr, "warning: #%d/'%s': path resolution error %d", d->ino, d->name, ret);
+      return;
+    }
+  }
+  dbg("#%-8d i%-8d d%-8ld '%s'", i->ino, d->ino, (char *)d - dirents.buffer, path);
+
+  if (opt_sum) {
+    struct sweep_file_t *f = sweep_file(i->ino);
+    char hex[65];
+    int n;
+
+    for (n = 0; f && n < 32; n++)
+      sprintf(hex + 2 * n, "%02x", f->digest[n]);
+    if (f)
+      printf("%s  %s%c", hex, path, newline);
+  } else if (opt_resolve_blocks) {
+    struct block_hit_t *hit;
+    struct block_hit_t *end = (struct block_hit_t *)(block_hits.buffer + block_hits.bytes_used);
+
+    for (hit = blocks_hits(i->ino); hit && hit < end && hit->ino == i->ino; hit++) {
+      printf("%llu ", (unsigned long long)hit->block);
+      format_show(i, d, path);
+    }
+  } else
+    format_show(i, d, path);
+}
+
+/* --block-order : selected dirents are sorted by the first physical block of
+ * their inode, so that reading the files goes (mostly) forward on disk */
+struct block_order_t {
+  __u64        block;
+  unsigned int dirent;
+};
+
+int block_order_cmp(const void *a, const void *b) {
+  const struct block_order_t *oa = a;
+  const struct block_order_t *ob = b;
+
+  if (oa->block != ob->block)
+    return oa->block < ob->block ? -1 : 1;
+  return oa->dirent < ob->dirent ? -1 : oa->dirent > ob->dirent;
+}
+
+void show_block_order() {
+  struct array order;
+  struct dirent_t *d;
+  struct dirent_t *end;
+  size_t n;
+
+  array_init(&order);
+  end = (struct dirent_t *)(dirents.buffer + dirents.bytes_used);
+  for (d = (struct dirent_t *)dirents.buffer; d < end; d = index_dirent_next(d)) {
+    struct block_order_t o;
+
+    if (!bitfield_get(iselect, ((struct inode_t *)(inodes.buffer + inodes_elsize * d->ino))->ino))
+      continue;
+    o.block = ((__u64 *)first_blocks.buffer)[d->ino];
+    o.dirent = (char *)d - dirents.buffer;
+    if (!array_add(&order, &o, sizeof(o)))
+      err(6, "realloc() for --block-order");
+  }
+  dbg("sorting %zu dirents by block", order.count);
+  qsort(order.buffer, order.count, sizeof(struct block_order_t), block_order_cmp);
+  for (n = 0; n < order.count; n++)
+    dirent_show((struct dirent_t *)(dirents.buffer + ((struct block_order_t *)order.buffer)[n].dirent));
+  free(order.buffer);
+}
+
+/* --sorted : paths in byte order, as LC_ALL=C sort, without sorting them. The
+ * entries of each folder are sorted by name, and the tree is walked depth
+ * first. A subfolder is sorted twice : as itself, and as the block of the
+ * paths below it, which all start with its name and a '/'. Entries whose
+ * name continues with a byte lower than '/' (eg. 'a' < 'a-b' < 'a/c') thus
+ * come between both. Dirent offsets are multiples of 4, the lowest bit of an
+ * item tells a block from an entry. */
+#define SORTED_BELOW 1
+
+int sorted_cmp(const void *a, const void *b) {
+  unsigned int oa = *(unsigned int *)a;
+  unsigned int ob = *(unsigned int *)b;
+  const unsigned char *na = (unsigned char *)((struct dirent_t *)(dirents.buffer + (oa & ~SORTED_BELOW)))->name;
+  const unsigned char *nb = (unsigned char *)((struct dirent_t *)(dirents.buffer + (ob & ~SORTED_BELOW)))->name;
+  int ca, cb;
+
+  for (; *na && *na == *nb; na++, nb++)
+    ;
+  ca = *na ? *na : oa & SORTED_BELOW ? '/' : 0;
+  cb = *nb ? *nb : ob & SORTED_BELOW ? '/' : 0;
+  return ca - cb;
+}
+
+void show_sorted() {
+  struct array stack; /* Items to show (entries) or to expand (blocks) */
+  struct array items; /* Of the folder being expanded */
+  struct dirent_t *d;
+  struct dirent_t *end;
+  unsigned int item;
+  unsigned int n;
+
+  tree_group(tree_key_parent, 1, &tree.children, &tree.children_at);
+  array_init(&stack);
+  array_init(&items);
+  end = (struct dirent_t *)(dirents.buffer + dirents.bytes_used);
+  for (d = (struct dirent_t *)dirents.buffer; d < end && *d->name; d = index_dirent_next(d))
+    ;
+  if (d < end) { /* The root folder, shown before what is below it */
+    item = ((char *)d - dirents.buffer) | SORTED_BELOW;
+    if (!array_add(&stack, &item, sizeof(item)))
+      err(6, "realloc() for --sorted");
+    item &= ~SORTED_BELOW;
+    if (!array_add(&stack, &item, sizeof(item)))
+      err(6, "realloc() for --sorted");
+  }
+
+  while (stack.count) {
+    stack.count--;
+    stack.bytes_used -= sizeof(item);
+    item = *(unsigned int *)(stack.buffer + stack.bytes_used);
+    d = (struct dirent_t *)(dirents.buffer + (item & ~SORTED_BELOW));
+    if (!(item & SORTED_BELOW)) {
+      dirent_show(d);
+      continue;
+    }
+
+    items.count = items.bytes_used = 0;
+    for (n = tree.children_at[d->ino]; n < tree.children_at[d->ino + 1]; n++) {
+      item = tree.children[n];
+      if (!array_add(&items, &item, sizeof(item)))
+        err(6, "realloc() for --sorted");
+      if (!bitfield_get(iisdir, tree_inode(((struct dirent_t *)(dirents.buffer + item))->ino)->ino))
+        continue;
+      item |= SORTED_BELOW;
+      if (!array_add(&items, &item, sizeof(item)))
+        err(6, "realloc() for --sorted");
+    }
+    qsort(items.buffer, items.count, sizeof(item), sorted_cmp);
+    for (n = items.count; n > 0; n--)
+      if (!array_add(&stack, (unsigned int *)items.buffer + n - 1, sizeof(item)))
+        err(6, "realloc() for --sorted");
+  }
+  free(stack.buffer);
+  free(items.buffer);
+  tree_free();
+}
+
+
+/* e2du : folders are listed parents first (breadth first from the root), then
+ * summed into their parent in reverse order, children before parents. Returns
+ * the number of folders, listed in *order (to be freed). */
+size_t du_sum(unsigned int **order_out) {
+  struct du_t *du = (struct du_t *)du_sizes.buffer;
+  unsigned int *order;
+  unsigned int *parents;
+  unsigned int root;
+  size_t count, n, i;
+
+  if (!inode_lookup(EXT2_ROOT_INO, &root))
+    err(8, "root folder not found");
+  tree_group(tree_key_parent, 1, &tree.children, &tree.children_at);
+  order = malloc(inodes.count * sizeof(unsigned int));
+  parents = malloc(inodes.count * sizeof(unsigned int));
+  if (!order || !parents)
+    err(6, "malloc() for e2du");
+
+  order[0] = root;
+  for (n = 0, count = 1; n < count; n++)
+    for (i = tree.children_at[order[n]]; i < tree.children_at[order[n] + 1] && count < inodes.count; i++) {
+      struct dirent_t *d = (struct dirent_t *)(dirents.buffer + tree.children[i]);
+
+      if (!bitfield_get(iisdir, tree_inode(d->ino)->ino))
+        continue; /* Kept for an index, already summed */
+      parents[count] = order[n];
+      order[count++] = d->ino;
+    }
+  dbg("[du] Summing %zu folders", count);
+  for (n = count - 1; n > 0; n--) {
+    du[parents[n]].size   += du[order[n]].size;
+    du[parents[n]].blocks += du[order[n]].blocks;
+    du[parents[n]].count  += du[order[n]].count;
+  }
+  free(parents);
+  *order_out = order;
+  return count;
+}
+
+void du_run() {
+  struct du_t *du = (struct du_t *)du_sizes.buffer;
+  unsigned int *order;
+  size_t count, n;
+  char path[PATH_MAX];
+  int ret;
+
+  count = du_sum(&order);
+  for (n = 0; n < count; n++)
+    top_add(opt_top_by == TOP_SIZE ? du[order[n]].size : opt_top_by == TOP_COUNT ? du[order[n]].count :
+      du[order[n]].blocks, order[n]);
+  qsort(top, top_count, sizeof(struct top_t), top_cmp);
+  for (n = 0; n < top_count; n++) {
+    struct du_t *u = &du[top[n].idx];
+
+    ret = dirent_to_path((struct dirent_t *)(dirents.buffer + tree_inode(top[n].idx)->dirent), path, PATH_MAX);
+    if (ret) {
+      fprintf(stderr, "warning: #%d: path resolution error %d\n", tree_inode(top[n].idx)->ino, ret);
+      continue;
+    }
+    printf("%llu\t%llu\t%llu\t%s%c", (unsigned long long)u->blocks * 512, (unsigned long long)u->size,
+      (unsigned long long)u->count, path, newline);
   }
-  else if (opt_show_mtime) {
-    inodes_eltype = INODES_MTIME;
-    inodes_elsize = sizeof(struct inode_t) - 4;
+  free(order);
+}
+
+/* --usage report, see usage_add(). With --usage=dirs, the root folder and its
+ * subfolders come from du_sum(). */
+void usage_show(const char *kind, struct usage_t *u, const char *name) {
+  printf("%s\t%s\t%llu\t%llu\t%llu%c", kind, name, (unsigned long long)u->blocks * 512, (unsigned long long)u->size,
+    (unsigned long long)u->count, newline);
+}
+
+void usage_report() {
+  struct usage_t *u;
+  char id[16];
+  size_t n;
+
+  for (n = 0, u = (struct usage_t *)usage_uids.buffer; n < usage_uids.count; n++, u++) {
+    snprintf(id, sizeof(id), "%u", u->id);
+    usage_show("uid", u, id);
   }
-  else if (opt_show_ctime) {
-    inodes_eltype = INODES_CTIME;
-    inodes_elsize = sizeof(struct inode_t) - 4;
+  for (n = 0, u = (struct usage_t *)usage_gids.buffer; n < usage_gids.count; n++, u++) {
+    snprintf(id, sizeof(id), "%u", u->id);
+    usage_show("gid", u, id);
   }
-  else {
-    inodes_eltype = INODES_NONE;
-    inodes_elsize = sizeof(struct inode_t) - 8;
+  for (n = 0; n < USAGE_AGES; n++)
+    usage_show("age", &usage_ages[n], usage_age_names[n]);
+
+  if (opt_usage == USAGE_DIRS) {
+    struct du_t *du = (struct du_t *)du_sizes.buffer;
+    unsigned int *order;
+    unsigned int root;
+    size_t i;
+
+    du_sum(&order);
+    root = order[0];
+    printf("dir\t/\t%llu\t%llu\t%llu%c", (unsigned long long)du[root].blocks * 512,
+      (unsigned long long)du[root].size, (unsigned long long)du[root].count, newline);
+    for (i = tree.children_at[root]; i < tree.children_at[root + 1]; i++) {
+      struct dirent_t *d = (struct dirent_t *)(dirents.buffer + tree.children[i]);
+
+      if (bitfield_get(iisdir, tree_inode(d->ino)->ino))
+        printf("dir\t/%s\t%llu\t%llu\t%llu%c", d->name, (unsigned long long)du[d->ino].blocks * 512,
+          (unsigned long long)du[d->ino].size, (unsigned long long)du[d->ino].count, newline);
+    }
+    free(order);
   }
-  dbg("inodes[] element size is %zu bytes", inodes_elsize);
+}
 
-  /* Pass 1 : inode scan. Fills in :
-   *
-   * - inodes[] : FIXME
-   * - iisdir[] :
-   * - iselect[] :
-   */
-  ret = ext2fs_open_inode_scan(fs, buffer_blocks, &scan);
+/* --count without filter : used inodes and folders, as told by the group
+ * descriptors (no inode table is read) */
+void count_groups() {
+  __u64 inodes = 0;
+  __u64 folders = 0;
+  dgrp_t group;
+  int ret;
+
+  ret = ext2fs_open(fspath, 0, 0, 0, unix_io_manager, &fs);
   if (ret)
-    err(7, "ext2fs_open_inode_scan: error %d", ret);
+    err(5, "ext2fs_open(%s): error %d", fspath, ret);
+  for (group = 0; group < fs->group_desc_count; group++) {
+    inodes  += fs->super->s_inodes_per_group - ext2fs_bg_free_inodes_count(fs, group);
+    folders += ext2fs_bg_used_dirs_count(fs, group);
+  }
+  inodes -= EXT2_GOOD_OLD_FIRST_INO - 2; /* Special inodes, but the root folder, as pass 1 */
+  ext2fs_close(fs);
+  fs = NULL;
+  printf("inodes\t%llu%c", (unsigned long long)inodes, newline);
+  printf("folders\t%llu%c", (unsigned long long)folders, newline);
+}
 
-  dbg("[1] Inode scan");
-  scanned = 0;
-  used = 0;
-  selected = 0;
-  while(1) {
-    ext2_ino_t ino;
-    struct ext2_inode inode;
-    struct inode_t i;
+/* A value of count_vector(), with its --sample margin */
+void count_value(__u64 value, int k, int unit) {
+  printf("\t%llu", (unsigned long long)value * unit);
+  if (count_margined)
+    printf("~%.0f", count_margins[k] * unit);
+}
 
-    ret = ext2fs_get_next_inode(scan, &ino, &inode);
-    if (ret) {
-      fprintf(stderr, "warning: selecting inode #%d: scan error %d\n", ino, ret);
+/* --count and --summary, after pass 1 */
+void count_report() {
+  struct count_t total;
+  int n;
+
+  memset(&total, 0, sizeof(total));
+  for (n = 0; n < COUNT_TYPES; n++) {
+    total.count  += count_types[n].count;
+    total.size   += count_types[n].size;
+    total.blocks += count_types[n].blocks;
+  }
+  if (opt_count == COUNT_INODES) {
+    printf("inodes");
+    count_value(total.count, 0, 1);
+    printf("%cfolders", newline);
+    count_value(count_types[1].count, 3 + 3, 1);
+    putchar(newline);
+    return;
+  }
+
+  /* As "kind key inodes allocated apparent" lines */
+  for (n = 0; n < COUNT_TYPES; n++) {
+    if (!count_types[n].count)
       continue;
-    }
+    printf("type\t%s", count_type_names[n]);
+    count_value(count_types[n].count, 3 + n * 3, 1);
+    count_value(count_types[n].blocks, 3 + n * 3 + 2, 512);
+    count_value(count_types[n].size, 3 + n * 3 + 1, 1);
+    putchar(newline);
+  }
+  for (n = 0; n < COUNT_LINKS; n++) {
+    if (!count_links[n])
+      continue;
+    if (n < 2)
+      printf("links\t%u", 1U << n);
+    else
+      printf("links\t%u-%u", (1U << (n - 1)) + 1, 1U << n);
+    count_value(count_links[n], 3 + COUNT_TYPES * 3 + n, 1);
+    putchar(newline);
+  }
+  printf("total\t-");
+  count_value(total.count, 0, 1);
+  count_value(total.blocks, 2, 512);
+  count_value(total.size, 1, 1);
+  putchar(newline);
+}
 
-    if (ino == 0) {
-      dbg("selection: all inodes seen, ending scan loop");
-      break;
+/* --ncdu : the whole tree in ncdu's JSON export format, depth first. A folder
+ * is an array of its own info followed by its entries. */
+struct ncdu_level_t {
+  unsigned int dir;  /* inodes[] index */
+  unsigned int next; /* Next entry in tree.children[] */
+};
+
+void ncdu_name(const char *name) {
+  const unsigned char *c;
+
+  putchar('"');
+  for (c = (const unsigned char *)name; *c; c++)
+    if (*c == '"' || *c == '\\')
+      printf("\\%c", *c);
+    else if (*c < 0x20)
+      printf("\\u%04x", *c);
+    else
+      putchar(*c);
+  putchar('"');
+}
+
+void ncdu_info(const char *name, unsigned int idx) {
+  struct du_t *u = (struct du_t *)du_sizes.buffer + idx;
+
+  printf("{\"name\":");
+  ncdu_name(name);
+  printf(",\"asize\":%llu,\"dsize\":%llu,\"ino\":%u,\"mtime\":%u",
+    (unsigned long long)u->size, (unsigned long long)u->blocks * 512, tree_inode(idx)->ino, u->mtime);
+  if (!LINUX_S_ISDIR(u->mode) && u->links > 1)
+    printf(",\"hlnkc\":true,\"nlink\":%u", u->links);
+  if (!LINUX_S_ISDIR(u->mode) && !LINUX_S_ISREG(u->mode))
+    printf(",\"notreg\":true");
+  putchar('}');
+}
+
+void ncdu_export() {
+  struct ncdu_level_t level;
+  struct array stack;
+
+  if (!inode_lookup(EXT2_ROOT_INO, &level.dir))
+    err(8, "root folder not found");
+  tree_group(tree_key_parent, 1, &tree.children, &tree.children_at);
+
+  printf("[1,1,{\"progname\":\"%s\",\"progver\":\"%s\",\"timestamp\":%lu},\n[", program_name, program_version,
+    (unsigned long)time(NULL));
+  ncdu_info("/", level.dir);
+  level.next = tree.children_at[level.dir];
+  array_init(&stack);
+  array_add(&stack, &level, sizeof(level));
+  while (stack.count) {
+    struct ncdu_level_t *cur = (struct ncdu_level_t *)(stack.buffer + stack.bytes_used) - 1;
+    struct dirent_t *d;
+
+    if (cur->next == tree.children_at[cur->dir + 1]) {
+      putchar(']');
+      stack.count--;
+      stack.bytes_used -= sizeof(level);
+      continue;
     }
-    scanned++;
+    d = (struct dirent_t *)(dirents.buffer + tree.children[cur->next++]);
+    printf(",\n");
+    if (bitfield_get(iisdir, tree_inode(d->ino)->ino)) {
+      putchar('[');
+      ncdu_info(d->name, d->ino);
+      level.dir = d->ino;
+      level.next = tree.children_at[d->ino];
+      array_add(&stack, &level, sizeof(level));
+    } else
+      ncdu_info(d->name, d->ino);
+  }
+  printf("]\n");
+  free(stack.buffer);
+}
 
-    if ((ino < EXT2_GOOD_OLD_FIRST_INO && ino != EXT2_ROOT_INO) || /* Ignore special inodes - except the root one */
-        inode.i_links_count == 0)                                  /* Ignore unused inode */
+/* --top : the winners of pass 1, largest first, with their key (sizes in
+ * bytes) and one of their names */
+void show_top() {
+  size_t n;
+
+  qsort(top, top_count, sizeof(struct top_t), top_cmp);
+  for (n = 0; n < top_count; n++) {
+    struct inode_t *i = tree_inode(top[n].idx);
+
+    if (!i->dirent && i->ino != EXT2_ROOT_INO)
+      continue; /* Orphan */
+    printf("%llu ", (unsigned long long)(opt_top_by == TOP_SIZE ? top[n].key : top[n].key * 512));
+    dirent_show((struct dirent_t *)(dirents.buffer + i->dirent));
+  }
+}
+
+
+void prefix_add(struct array *paths, char *path) {
+  if (!paths->buffer)
+    array_init(paths);
+  if (!array_add(paths, &path, sizeof(path)))
+    err(6, "realloc() for subtrees");
+}
+
+/* --exclude-from : a path per line */
+void prefix_read(const char *file) {
+  char line[PATH_MAX + 1];
+  char *path;
+  FILE *f;
+
+  f = fopen(file, "r");
+  if (!f)
+    err(11, "--exclude-from: fopen(%s): %s", file, strerror(errno));
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!*line || *line == '#')
+      continue;
+    path = strdup(line);
+    if (!path)
+      err(6, "strdup() for --exclude-from");
+    prefix_add(&excludes, path);
+  }
+  fclose(f);
+}
+
+/* --compress : stdout goes through a zstd or lz4 child process, which
+ * compresses the output while it is being produced. zstd uses all cores. */
+static pid_t compress_pid = 0;
+
+void compress_end() {
+  int status;
+
+  if (fclose(stdout) != 0)
+    fprintf(stderr, "warning: --compress: writing output: %s\n", strerror(errno));
+  if (waitpid(compress_pid, &status, 0) != compress_pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "%s: --compress: %s failed\n", program_name, opt_compress);
+    _exit(18); /* From an atexit() handler */
+  }
+}
+
+void compress_start() {
+  int fds[2];
+
+  if (pipe(fds) != 0)
+    err(18, "pipe(): %s", strerror(errno));
+  fflush(stdout);
+  compress_pid = fork();
+  if (compress_pid < 0)
+    err(18, "fork(): %s", strerror(errno));
+  if (compress_pid == 0) {
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    if (strcmp(opt_compress, "zstd") == 0)
+      execlp("zstd", "zstd", "-q", "-c", "-T0", NULL);
+    else
+      execlp("lz4", "lz4", "-q", "-c", NULL);
+    fprintf(stderr, "%s: --compress: exec(%s): %s\n", program_name, opt_compress, strerror(errno));
+    _exit(18);
+  }
+  dup2(fds[1], STDOUT_FILENO);
+  close(fds[0]);
+  close(fds[1]);
+  atexit(compress_end);
+  dbg("--compress: output goes through %s (pid %d)", opt_compress, compress_pid);
+}
+
+/* Modes and output options which cannot be combined. A pair only needs to be
+ * declared in the conflicts of one of the two, see options_check() */
+#define MODE_RESOLVE_INODES (1 << 0)
+#define MODE_INCREMENTAL    (1 << 1)
+#define MODE_SAVE_INDEX     (1 << 2)
+#define MODE_SERVE          (1 << 3)
+#define MODE_DIFF           (1 << 4)
+#define MODE_RESOLVE_BLOCKS (1 << 5)
+#define MODE_BLOCK_ORDER    (1 << 6)
+#define MODE_SUM            (1 << 7)
+#define MODE_ARCHIVE        (1 << 8)
+#define MODE_DU             (1 << 9)
+#define MODE_NCDU           (1 << 10)
+#define MODE_TOP            (1 << 11)
+#define MODE_USAGE          (1 << 12)
+#define MODE_COUNT          (1 << 13)
+#define MODE_SAMPLE         (1 << 14)
+#define MODE_NAMES          (1 << 15)
+#define MODE_FILTER         (1 << 16)
+#define MODE_SUBTREE        (1 << 17)
+#define MODE_SHOW_TIME      (1 << 18)
+#define MODE_FORMAT         (1 << 19)
+#define MODE_BINARY         (1 << 20)
+#define MODE_SORTED         (1 << 21)
+#define MODE_COMPRESS       (1 << 22)
+
+/* Reports : they have their own output and read everything */
+#define MODE_REPORTS (MODE_DU | MODE_NCDU | MODE_TOP | MODE_USAGE | MODE_COUNT)
+
+static const struct {
+  unsigned int mode;
+  const char  *name;
+  unsigned int conflicts;
+} option_modes[] = {
+  { MODE_RESOLVE_INODES, "--resolve-inodes", 0 },
+  { MODE_INCREMENTAL,    "--incremental", 0 },
+  { MODE_SAVE_INDEX,     "--save-index", 0 },
+  { MODE_SERVE,          "--serve", 0 },
+  { MODE_DIFF,           "--diff", MODE_SERVE },
+  { MODE_RESOLVE_BLOCKS, "--resolve-blocks", MODE_RESOLVE_INODES | MODE_INCREMENTAL | MODE_SERVE },
+  { MODE_BLOCK_ORDER,    "--block-order", 0 },
+  { MODE_SUM,            "e2sum", MODE_RESOLVE_BLOCKS | MODE_INCREMENTAL | MODE_SERVE | MODE_DIFF },
+  { MODE_ARCHIVE,        "--archive", MODE_SUM | MODE_RESOLVE_BLOCKS | MODE_INCREMENTAL | MODE_SERVE | MODE_DIFF },
+  { MODE_DU,             "e2du", MODE_ARCHIVE | MODE_RESOLVE_BLOCKS | MODE_SERVE | MODE_DIFF },
+  { MODE_NCDU,           "--ncdu", MODE_SUM | MODE_ARCHIVE | MODE_RESOLVE_BLOCKS | MODE_SERVE | MODE_DIFF },
+  { MODE_TOP,            "--top", MODE_SUM | MODE_ARCHIVE | MODE_NCDU | MODE_RESOLVE_BLOCKS | MODE_SERVE | MODE_DIFF |
+                                  MODE_BLOCK_ORDER },
+  { MODE_USAGE,          "--usage", MODE_DU | MODE_SUM | MODE_ARCHIVE | MODE_NCDU | MODE_TOP | MODE_RESOLVE_BLOCKS |
+                                    MODE_SERVE | MODE_DIFF | MODE_BLOCK_ORDER },
+  { MODE_COUNT,          "--count and --summary", MODE_USAGE | MODE_DU | MODE_SUM | MODE_ARCHIVE | MODE_NCDU | MODE_TOP |
+                                                  MODE_RESOLVE_BLOCKS | MODE_SERVE | MODE_DIFF | MODE_BLOCK_ORDER },
+  { MODE_SAMPLE,         "--sample", MODE_INCREMENTAL | MODE_SAVE_INDEX },
+  { MODE_NAMES,          "--name, --iname, --regex and subtrees", MODE_REPORTS | MODE_ARCHIVE | MODE_SERVE | MODE_DIFF },
+  { MODE_FILTER,         "--filter and --after", MODE_DU | MODE_NCDU }, /* Which account every file */
+  { MODE_SUBTREE,        "--subtree", MODE_DU | MODE_SUM | MODE_ARCHIVE | MODE_NCDU | MODE_RESOLVE_BLOCKS |
+                                      MODE_RESOLVE_INODES | MODE_INCREMENTAL | MODE_SAVE_INDEX | MODE_SERVE |
+                                      MODE_DIFF | MODE_SAMPLE },
+  { MODE_SHOW_TIME,      "--show-mtime and --show-ctime", 0 },
+  { MODE_FORMAT,         "--format", MODE_SHOW_TIME | MODE_REPORTS | MODE_SUM | MODE_ARCHIVE | MODE_SERVE | MODE_DIFF },
+  { MODE_BINARY,         "--binary", MODE_REPORTS | MODE_SUM | MODE_ARCHIVE | MODE_RESOLVE_BLOCKS | MODE_SERVE |
+                                     MODE_DIFF },
+  { MODE_SORTED,         "--sorted", MODE_REPORTS | MODE_ARCHIVE | MODE_SERVE | MODE_DIFF | MODE_BLOCK_ORDER },
+  { MODE_COMPRESS,       "--compress", MODE_SERVE },
+};
+
+/* The modes of the command line. --top is a mode of its own, except as the
+ * e2du option. */
+unsigned int options_modes() {
+  return (opt_resolve_inodes ? MODE_RESOLVE_INODES : 0) |
+         (opt_incremental ? MODE_INCREMENTAL : 0) |
+         (opt_save_index ? MODE_SAVE_INDEX : 0) |
+         (opt_serve ? MODE_SERVE : 0) |
+         (opt_diff ? MODE_DIFF : 0) |
+         (opt_resolve_blocks ? MODE_RESOLVE_BLOCKS : 0) |
+         (opt_block_order ? MODE_BLOCK_ORDER : 0) |
+         (opt_sum ? MODE_SUM : 0) |
+         (opt_archive ? MODE_ARCHIVE : 0) |
+         (opt_du ? MODE_DU : 0) |
+         (opt_ncdu ? MODE_NCDU : 0) |
+         (opt_top && !opt_du ? MODE_TOP : 0) |
+         (opt_usage ? MODE_USAGE : 0) |
+         (opt_count ? MODE_COUNT : 0) |
+         (opt_sample ? MODE_SAMPLE : 0) |
+         (names_count || prefixes.count || excludes.count ? MODE_NAMES : 0) |
+         (filter.count ? MODE_FILTER : 0) |
+         (opt_subtree ? MODE_SUBTREE : 0) |
+         (opt_show_mtime || opt_show_ctime ? MODE_SHOW_TIME : 0) |
+         (format.count ? MODE_FORMAT : 0) |
+         (opt_binary ? MODE_BINARY : 0) |
+         (opt_sorted ? MODE_SORTED : 0) |
+         (opt_compress ? MODE_COMPRESS : 0);
+}
+
+/* Rejects the combinations of option_modes[], and options missing theirs */
+void options_check() {
+  unsigned int modes = options_modes();
+  size_t m, n;
+
+  for (m = 0; m < sizeof(option_modes) / sizeof(*option_modes); m++) {
+    if (!(modes & option_modes[m].mode))
       continue;
-    used++; /* OK, this is a used inode, let's record some data */
+    for (n = 0; n < m; n++)
+      if ((modes & option_modes[n].mode) &&
+          ((option_modes[m].conflicts & option_modes[n].mode) || (option_modes[n].conflicts & option_modes[m].mode)))
+        err(1, "%s cannot be used with %s", option_modes[m].name, option_modes[n].name);
+  }
+  if (opt_sample && !opt_count)
+    err(1, "--sample requires --count or --summary");
+  if (opt_top_by == TOP_COUNT && !opt_du)
+    err(1, "--by count is only for e2du");
+}
+
+int main(int argc, char **argv) {
+  int opti = 0;
+  int optc;
+  char *blkpath;
+  char *anyp;
+  unsigned int index;
 
-    /* Update iflags[] */
-    if (LINUX_S_ISDIR(inode.i_mode))
-      bitfield_set(iisdir, ino);
-    if (opt_after && (inode.i_mtime >= opt_after || inode.i_ctime >= opt_after))
-      bitfield_set(iselect, ino);
+  if (strcmp(basename(argv[0]), "e2sum") == 0) {
+    program_name = "e2sum";
+    opt_sum = 1;
+  }
+  if (strcmp(basename(argv[0]), "e2du") == 0) {
+    program_name = "e2du";
+    opt_du = 1;
+  }
 
-    /* Update inodes[] */
-    i.ino = ino;
-    i.dirent = 0;
-    switch (inodes_eltype) {
-      case INODES_NONE:
+  while ((optc = getopt_long(argc, argv, "0a:AbBcCdD:e:E:f:F:g:G:hiI:j::mnNo:OpP:rRsS:t:T:uU::vx:X:y:z:", optl, &opti)) != -1) {
+    switch (optc) {
+      case '0':
+        newline = '\0';
+        break;
+      case 'a':
+        if (!*optarg || strspn(optarg, "0123456789.") != strlen(optarg))
+          err(11, "--after: positive number expected");
+        opt_after = optarg;
+        break;
+      case 'A':
+        opt_archive = 1;
+        break;
+      case 'b':
+        opt_resolve_blocks = 1;
+        break;
+      case 'B':
+        opt_block_order = 1;
+        break;
+      case 'c':
+        opt_show_ctime = 1;
+        break;
+      case 'C':
+        opt_show_change = 1;
+        break;
+      case 'd':
+        opt_debug = 1;
+        break;
+      case 'D':
+        opt_diff = optarg;
+        break;
+      case 'e':
+        format_compile(optarg);
+        break;
+      case 'E':
+        names_add(0, optarg, 0);
+        break;
+      case 'f':
+        opt_filter = optarg;
+        break;
+      case 'F':
+        prefix_read(optarg);
+        break;
+      case 'g':
+        names_add(0, optarg, 1);
+        break;
+      case 'G':
+        names_add(1, optarg, 1);
         break;
-      case INODES_MTIME:
-        i.time1 = inode.i_mtime;
+      case 'h':
+        show_help();
+        exit(0);
+      case 'i':
+        opt_image = 1;
+        break;
+      case 'I':
+        opt_incremental = optarg;
+        break;
+      case 'j':
+        opt_journal = 1;
+        if (optarg && !sscanf(optarg, "%u", &opt_journal_since))
+          err(11, "--journal: positive integer expected");
+        break;
+      case 'm':
+        opt_show_mtime = 1;
+        break;
+      case 'n':
+        if (!opt_count)
+          opt_count = COUNT_INODES;
+        break;
+      case 'N':
+        opt_ncdu = 1;
+        break;
+      case 'o':
+        opt_save_index = optarg;
+        break;
+      case 'O':
+        opt_sorted = 1;
+        break;
+      case 'p':
+        opt_mountpoint = 1;
+        break;
+      case 'P':
+        if (sscanf(optarg, "%lf", &opt_sample) != 1 || opt_sample <= 0 || opt_sample > 100)
+          err(11, "--sample: percentage expected");
+        break;
+      case 'r':
+        opt_resolve_inodes = 1;
+        break;
+      case 'R':
+        opt_binary = 1;
+        break;
+      case 's':
+        opt_count = COUNT_SUMMARY;
+        break;
+      case 'S':
+        opt_serve = optarg;
+        break;
+      case 't':
+        if (sscanf(optarg, "%zu", &opt_top) != 1 || !opt_top)
+          err(11, "--top: positive integer expected");
+        break;
+      case 'T':
+        opt_subtree = optarg;
+        break;
+      case 'u':
+        opt_unique = 1;
+        break;
+      case 'U':
+        opt_usage = USAGE_INODES;
+        if (optarg && strcmp(optarg, "dirs") == 0)
+          opt_usage = USAGE_DIRS;
+        else if (optarg)
+          err(11, "--usage: 'dirs' expected");
+        break;
+      case 'v':
+        show_version();
+        exit(0);
+      case 'x':
+        prefix_add(&prefixes, optarg);
         break;
-      case INODES_CTIME:
-        i.time1 = inode.i_ctime;
+      case 'X':
+        prefix_add(&excludes, optarg);
         break;
-      case INODES_MTIME_CTIME: ;
-        i.time1 = inode.i_mtime;
-        i.time2 = inode.i_ctime;
+      case 'y':
+        if (strcmp(optarg, "size") == 0)
+          opt_top_by = TOP_SIZE;
+        else if (strcmp(optarg, "blocks") == 0)
+          opt_top_by = TOP_BLOCKS;
+        else if (strcmp(optarg, "count") == 0)
+          opt_top_by = TOP_COUNT;
+        else
+          err(11, "--by: size, blocks or count expected");
         break;
+      case 'z':
+        if (strcmp(optarg, "zstd") != 0 && strcmp(optarg, "lz4") != 0)
+          err(11, "--compress: zstd or lz4 expected");
+        opt_compress = optarg;
+        break;
+      case '?':
+        exit(10);
     }
-    dbg("+%8d #%8d", used-1, ino);
-    array_add(&inodes, &i, inodes_elsize);
   }
-  dbg("inode scan done, %d scanned (%.1f%%)", scanned, scanned * 100. / fs->super->s_inodes_count);
-  dbg("%d inode selected out of %d used inodes (%.1f%%)", selected, used, selected * 100. / used);
 
-  ext2fs_close_inode_scan(scan);
+  if (optind >= argc)
+    err(1, "missing filesystem path or blockdev");
 
+  /* --after is a shortcut for a filter */
+  if (opt_filter)
+    filter_compile(opt_filter);
+  if (opt_after) {
+    char after[64];
 
-  /* Pass 2 : dirent scan.
-   *
-   * In order to run ino->fullpath inverse resolutions, we need to collect all
-   * dirents with parenting information. This loop run ext2fs_dir_iterate() on
-   * every folder inode. The dirent_cb() callback fills dirents[] in.
-   */
-  dbg("[2] Dirent scan");
-  for (index = 0, anyp = inodes.buffer; index < inodes.count; anyp += inodes_elsize, index++) {
-    /* The block_buf parameter should either be NULL, or if the
-     * ext2fs_dir_iterate function is called repeatedly, the overhead of
-     * allocating and freeing scratch memory can be avoided by passing a
-     * pointer to a scratch buffer which must be at least as big as the
-     * filesystem’s blocksize. */
-    char dirbuf[64*1024];
-    struct inode_t *ip;
-    ext2_ino_t ino;
-    struct dirent_cb_t cb;
+    snprintf(after, sizeof(after), "after %.56s", opt_after);
+    filter_compile(after);
+  }
+  if (names_count)
+    names_compile();
+  fspath = argv[optind];
 
-    ip = (struct inode_t *)anyp;
-    ino = ip->ino;
+  options_check();
+  if (opt_top_by == -1)
+    opt_top_by = opt_du ? TOP_BLOCKS : TOP_SIZE;
+  top_max = opt_top ? opt_top : opt_du ? 20 : 0;
+  if (opt_compress)
+    compress_start();
 
-    if (!bitfield_get(iisdir, ip->ino)) /* Filter non-dir inodes */
-      continue;
+  /* Diff between two saved indexes, no need to open the filesystem */
+  if (opt_diff && index_is(fspath)) {
+    struct index_t new;
 
-    dbg("#%-8d i%d (folder)", ino, index);
-    cb.parent_ino = ino;
-    cb.parent_ino_idx = index;
-    ret = ext2fs_dir_iterate(fs, ino, 0, dirbuf, dirent_cb, &cb);
-    if (ret)
-      err(8, "ext2fs_dir_iterate: error %d", ret);
+    if (!index_load(opt_diff, &previous) || !index_load(fspath, &new))
+      err(13, "--diff: unusable index");
+    if (memcmp(previous.header->uuid, new.header->uuid, sizeof(new.header->uuid)) != 0)
+      err(13, "--diff: indexes were made from different filesystems");
+    index_diff(&previous, &new);
+    return 0;
   }
-  dbg("dirent scan done (%zu dirents)", dirents.count);
 
-  ext2fs_close(fs);
+  if (!opt_image && strncmp(fspath, "/dev/", 5) != 0) {
+    struct stat stat;
 
-  /* Pass 2.5 : fix dirents[] .parent-as-inodes[]-index into .parent-as-dirents[]-index
-   */
-  dbg("[2.5] Converting dirents[].parent");
-  for (index = 0, anyp = dirents.buffer; index < dirents.count; index++) {
-    struct dirent_t *d;
-    struct inode_t *ip;
-    size_t name_len;
+    dbg("'%s' does not look like a blkdev, calling blkid", fspath);
+    if (lstat(fspath, &stat) != 0)
+      err(3, "lstat(%s): %s", fspath, strerror(errno));
 
-    d = (struct dirent_t *)anyp;
-    ip = (struct inode_t *)(inodes.buffer + inodes_elsize * d->parent);
-    dbg("d%-8ld %-24s : i%-8d -> d%-8d", anyp - dirents.buffer, d->name, d->parent,  ip->dirent);
-    d->parent = ip->dirent;
+    if (opt_mountpoint && stat.st_ino != EXT2_ROOT_INO)
+      err(9, "%s is not an ext2/3/4 mountpoint", fspath);
 
-    name_len = strlen(d->name);
-    anyp += sizeof(struct dirent_empty_t) + ((name_len + 4) & ~3);
+    blkpath = blkid_devno_to_devname(stat.st_dev);
+    if (!blkpath)
+      err(4, "blkid_devno_to_devname(%lu) failed", stat.st_dev);
+    dbg("'%s' mapped to blkdev '%s'", fspath, blkpath);
+    fspath = blkpath;
+  } else {
+    if (opt_mountpoint)
+      err(9, "%s is not an ext2/3/4 mountpoint", fspath);
   }
 
-  /* Pass 3 : iterate over dirents[], resolving fullpaths and displaying result
-   */
-  dbg("[3] Iterate over dirents");
-  for (index = 0, anyp = dirents.buffer; index < dirents.count; index++) {
-    struct dirent_t *d;
-    struct inode_t *i;
-    char path[PATH_MAX];
-    char prefix[32];
-    int ret;
-    size_t name_len;
+  /* Preset formats, ended by the newline (which may be a 0) */
+  if (!format.count) {
+    if (opt_show_mtime && opt_show_ctime)
+      format_compile("%10Ts %10Cs %p");
+    else if (opt_show_mtime)
+      format_compile("%10Ts %p");
+    else if (opt_show_ctime)
+      format_compile("%10Cs %p");
+    else
+      format_compile("%p");
+    format_emit(format_text, 0, -1, &newline, 1);
+  }
+  /* --serve answers --after queries, it always needs both times */
+  if (opt_serve)
+    inode_fields_needed[FIELD_MTIME] = inode_fields_needed[FIELD_CTIME] = 1;
+  format_layout();
 
-    d = (struct dirent_t *)anyp;
-    i = (struct inode_t *)(inodes.buffer + inodes_elsize * d->ino);
-    if (!bitfield_get(iselect, i->ino))
-      goto next_dirent; /* Not selected for output */
-    if (opt_unique)
-      bitfield_clear(iselect, i->ino); /* Don't print another name for this inode */
+  if (opt_count == COUNT_INODES && !scan_filtered()) {
+    count_groups();
+    return 0;
+  }
 
-    ret = dirent_to_path(d, path, PATH_MAX);
-    if (ret) {
-      fprintf(stderr, "warning: #%d/'%s': path resolution error %d", d->ino, d->name, ret);
-      goto next_dirent;
-    }
-    dbg("#%-8d i%-8d d%-8ld '%s'", i->ino, d->ino, anyp - dirents.buffer, path);
+  scan_fs();
 
-    switch (inodes_eltype) {
-      case INODES_NONE:
-        *prefix = '\0';
-        break;
-      case INODES_MTIME:
-      case INODES_CTIME:
-        snprintf(prefix, 32, "%10d ", i->time1);
-        break;
-      case INODES_MTIME_CTIME: ;
-        snprintf(prefix, 32, "%10d %10d ", i->time1, i->time2);
-        break;
+  if (opt_diff) {
+    struct index_t new;
+
+    if (!index_load(opt_save_index, &new))
+      err(13, "--diff: cannot load the current scan index");
+    if (diff_tmp)
+      unlink(diff_tmp);
+    index_diff(&diffbase, &new);
+    return 0;
+  }
+
+  if (opt_serve) {
+    /* Refreshes are incremental from the index of the previous scan */
+    if (opt_save_index)
+      opt_incremental = opt_save_index;
+    opt_journal_since = 0;
+    tree_build();
+    serve(opt_serve);
+  }
+
+  if (opt_usage) {
+    usage_report();
+    return 0;
+  }
+  if (opt_count) {
+    count_report();
+    return 0;
+  }
+  if (opt_ncdu) {
+    ncdu_export();
+    return 0;
+  }
+  if (opt_du) {
+    du_run();
+    return 0;
+  }
+  if (opt_top) {
+    show_top();
+    return 0;
+  }
+
+  if (opt_sum || opt_archive) {
+    if (opt_archive)
+      tree_group(tree_key_ino, 0, &tree.names, &tree.names_at);
+    if (sweep_dirents()) {
+      if (prefixes.count || excludes.count)
+        prefix_resolve();
+      sweep_select();
     }
-    printf("%s%s%c", prefix, path, newline);
+    sweep_run();
+    ext2fs_close(fs);
+    fs = NULL;
+  }
+  if (opt_archive) {
+    tar_write(tar_zeros, sizeof(tar_zeros));
+    tar_write(tar_zeros, sizeof(tar_zeros));
+    if (fflush(stdout) != 0)
+      err(17, "writing archive: %s", strerror(errno));
+    return 0;
+  }
 
-  next_dirent:
-    name_len = strlen(d->name);
-    anyp += sizeof(struct dirent_empty_t) + ((name_len + 4) & ~3);
+  /* Pass 3 : iterate over dirents[], resolving fullpaths and displaying result
+   */
+  dbg("[3] Iterate over dirents");
+  if ((prefixes.count || excludes.count) && !sweep_dirents())
+    prefix_resolve(); /* Unless done for the sweep */
+  if (opt_binary) {
+    format_path = 1;
+    binary_header();
   }
+  if (opt_block_order)
+    show_block_order();
+  else if (opt_sorted)
+    show_sorted();
+  else
+    for (index = 0, anyp = dirents.buffer; index < dirents.count; index++) {
+      struct dirent_t *d;
+
+      d = (struct dirent_t *)anyp;
+      dirent_show(d);
+      anyp = (char *)index_dirent_next(d);
+    }
 
   return 0;
 }